@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+struct arenablock {
+  struct arenablock *next;
+  size_t size;      // usable bytes in data
+  size_t used;
+  size_t pad;       // keeps data aligned to ARENA_ALIGN
+  char data[];
+};
+
+// Every allocation is rounded up to this, which suits any type
+#define ARENA_ALIGN 16
+
+void *arenaAlloc(struct arena *a, size_t size) {
+  struct arenablock *b = a->blocks;
+  size_t blocksize;
+  void *p;
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  if(b == NULL || b->size - b->used < size) {
+    blocksize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+    b = (struct arenablock*)malloc(sizeof(struct arenablock) + blocksize);
+    if(!b) {
+      printf("Memory allocation unsuccessful! Exiting...\n");
+      exit(EXIT_FAILURE);
+    }
+    b->size = blocksize;
+    b->used = 0;
+
+    // A big request that got a block of its own doesn't waste the space left in the current one
+    if(a->blocks != NULL && blocksize > ARENA_BLOCK) {
+      b->next = a->blocks->next;
+      a->blocks->next = b;
+    }
+    else {
+      b->next = a->blocks;
+      a->blocks = b;
+    }
+  }
+
+  p = b->data + b->used;
+  b->used += size;
+  return p;
+}
+
+char *arenaStrndup(struct arena *a, const char *s, size_t len) {
+  char *p = (char*)arenaAlloc(a, len + 1);
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+void arenaReset(struct arena *a) {
+  struct arenablock *b, *next, *keep = NULL;
+
+  for(b = a->blocks; b != NULL; b = next) {
+    next = b->next;
+    if(keep == NULL && b->size == ARENA_BLOCK) {
+      keep = b;
+      continue;
+    }
+    free(b);
+  }
+
+  if(keep != NULL) {
+    keep->next = NULL;
+    keep->used = 0;
+  }
+  a->blocks = keep;
+}
+
+void arenaFree(struct arena *a) {
+  struct arenablock *b, *next;
+
+  for(b = a->blocks; b != NULL; b = next) {
+    next = b->next;
+    free(b);
+  }
+  a->blocks = NULL;
+}
@@ -0,0 +1,38 @@
+#include <stddef.h>
+
+/*
+    Arena (bump) allocator.
+
+    Memory is handed out from large blocks by moving a pointer forward, and is only ever
+    released all at once. Two lifetimes use it:
+
+    per batch:  everything that lives as long as the batch (loaded lines, argv arrays), so that
+                loading and parsing it costs one malloc() per block instead of several per line.
+                Released with arenaFree().
+    per line:   everything a line needs while it runs (pid list, argv of every pipeline stage).
+                Released with arenaReset() once the line is done, which keeps one block for the
+                next line: a batch of any length runs with the same few blocks.
+
+    An arena is not thread safe: threads that allocate at the same time use one arena each.
+*/
+
+// Default size of a block. Bigger requests get a block of their own.
+#define ARENA_BLOCK 65536
+
+struct arenablock;
+
+struct arena {
+    struct arenablock *blocks;  // most recent first; allocations come from the first one
+};
+
+// Returns size bytes aligned for any type. Exits if memory runs out.
+void *arenaAlloc(struct arena *a, size_t size);
+
+// Copies len bytes of s into the arena and NUL-terminates them
+char *arenaStrndup(struct arena *a, const char *s, size_t len);
+
+// Releases everything allocated so far, but keeps one block for the next allocations
+void arenaReset(struct arena *a);
+
+// Releases every block of the arena (the arena can be used again afterwards)
+void arenaFree(struct arena *a);
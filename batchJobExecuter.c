@@ -10,8 +10,75 @@ ID      :   2013A7P126G
     Assumptions:
 
     1. We assume that the single line comments are marked as '# ' (i.e. # followed by a space. Also, multi-line comments are ignored)
-    2. #INTERSTART and #INTERSTOP are not being handled as of now
+    2. Inside a section, the lines between #INTERSTART and #INTERSTOP also copy the data on every
+       pipe edge of their pipelines to INTER.<line>.<edge>.txt (see captureEdge())
     3. We assume that built-in shell are not part of the input file. (i.e., these are not handled)
+
+    Options:
+
+    -j N        Run lines whose dependencies have finished, up to N at a time (see jobs.h).
+                Their output still reaches OUTPUT.txt in the original line order.
+                Default is 1 (one line after the other).
+                Every line's block in OUTPUT.txt starts with a "### line <n>: exit <status>" header.
+    --dry-run   Only print the dependency graph computed for the batch file and the order
+                the lines would be started in. Nothing is executed.
+    --spawn=fork|posix
+                How commands are started: fork() + execve() (default), or posix_spawn(),
+                which doesn't copy the executor's page tables (see launchCommand()).
+    --plan-cache
+                Keep the compiled batch file in <file>.plan and load it from there on the
+                next runs, as long as the batch file doesn't change (see plan.h).
+    --job-timeout=SECS
+                Kill every line still running SECS seconds after it started (whole pipeline,
+                SIGTERM then SIGKILL). 0 (default) for no limit.
+    --no-fastpath
+                Always run cat as an external command. By default, a plain "cat <file>..." line
+                (no options, no pipe) is run by the executor itself, copying the files in the
+                kernel with copy_file_range() or sendfile(), with the same output and exit status.
+    --stream[=FIFO]
+                Read the batch from stdin (or from the named FIFO) instead of a file, and run
+                its lines as they arrive (see stream.h). A FIFO is never at EOF: the executor
+                keeps running the sections written to it until it is killed.
+    --serve=SOCKET
+                Run as a job server: listen on the Unix domain socket SOCKET and run the batches
+                its clients send, all of them with the same -j N limit (see server.h). The output
+                and exit status of every line go back to the client that sent it.
+    --submit=SOCKET
+                Send the batch file to the server listening on SOCKET, and print what it sends back.
+    --result-cache[=DIR]
+                Keep the output of the lines that succeed in DIR (default .batchcache, see
+                cache.h), keyed by their arguments, the programs they run and the content of
+                the files they name, and replay it instead of running a line again when none of
+                that has changed. Only for lines that depend on nothing else: precede the others
+                with %NOCACHE.
+                A hit/miss report is printed at the end.
+    --journal   Record every line in OUTPUT.journal once its block is written to OUTPUT.txt
+                (see journal.h), so that the run can be resumed if the executor or the host dies.
+    --resume    Go on with a run that died: the lines its journal says are done are skipped,
+                OUTPUT.txt is truncated after the last of them, and the rest of the batch runs
+                (journaled again).
+    --share-prefix
+                Run the leading stages that several lines have in common (e.g. the lines
+                "sort newhello.txt | uniq | wc -l" and "sort newhello.txt | uniq | head -3")
+                once, and feed their output to the rest of each line (see shareJobs()). The
+                number of process launches saved is printed at the end.
+    --sections[=N]
+                Run every %BEGIN/%END section as a unit: its lines one after the other, in
+                order, and up to N sections (default: one per CPU) at the same time, in place
+                of -j (see groupSections()). OUTPUT.txt still has the sections in order.
+    --stats     Record the resource usage of every line and pipeline stage in OUTPUT.stats.jsonl
+                (see stats.h), and print a summary table and the hit rate of the cache of
+                resolved command paths at the end.
+
+    Directives (inside %BEGIN/%END, apply to the next line):
+
+    %LABEL <name>   Names the next line.
+    %AFTER <name>   The next line must wait for the line named <name>.
+    %TIMEOUT <secs> The next line is killed if it runs for longer (0: no limit, even with --job-timeout).
+    %NOCACHE        The next line is always run, never replayed from the result cache.
+    %PARALLEL <n> [concat|sum|sort <options>]
+                    The file the next line reads is split into n parts, each run through its own
+                    copy of the line at the same time, and their outputs are merged (see execute.h).
 */
 
 #include <unistd.h>
@@ -19,6 +86,7 @@ ID      :   2013A7P126G
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <getopt.h>
 
 
 // for open() and dup2()
@@ -28,91 +96,297 @@ ID      :   2013A7P126G
 
 #include "parse.h"
 #include "execute.h"
+#include "jobs.h"
+#include "plan.h"
+#include "stats.h"
+#include "cache.h"
+#include "journal.h"
+#include "stream.h"
+#include "server.h"
+
+static int dryrun = 0;
+
+// Hands one entry of the batch to the scheduler
+static void addEntry(struct planentry *e) {
+
+    // Directives are never commands. %LABEL/%AFTER/%TIMEOUT/%NOCACHE/%PARALLEL only apply to the scheduling of the next line.
+    if(e->kind == PLAN_DIRECTIVE) {
+        if(!jobDirective(e->args))
+            printf("Unknown directive ignored: %s\n", e->args[0]);
+        return;
+    }
+
+    addJob(e->args, &e->command, e->lineno, e->section, e->flags);
+    if(!dryrun) printf("\n\n");
+}
 
 int main(int argc, char **argv) {
     
-    FILE *fp;
-    char* line = NULL;
-    size_t linesize;
+    struct plan plan;
+
+    int i;
+
+    int maxjobs = 1;    // number of lines kept in flight (-j)
+    int unterminated;
+    char *stream = NULL;    // --stream ("-" for stdin)
+    char *serve = NULL;     // --serve
+    char *submit = NULL;    // --submit
+    char *resultcache = NULL;   // --result-cache
+    int journal = 0;    // --journal, 2 for --resume
+    int shareprefix = 0;    // --share-prefix
+    int sections = 0;   // --sections, sections run at the same time
+    int streamfd;
+    int batchfd;
+    int usecache = 0;   // --plan-cache
+    int stats = 0;      // --stats
+    double timeout = 0; // --job-timeout
+    int opt;
+    char *batchfile;
+
+    static struct option longopts[] = {
+        { "dry-run", no_argument, NULL, 'n' },
+        { "spawn", required_argument, NULL, 's' },
+        { "plan-cache", no_argument, NULL, 'p' },
+        { "stats", no_argument, NULL, 'S' },
+        { "job-timeout", required_argument, NULL, 't' },
+        { "stream", optional_argument, NULL, 'r' },
+        { "no-fastpath", no_argument, NULL, 'F' },
+        { "serve", required_argument, NULL, 'L' },
+        { "submit", required_argument, NULL, 'C' },
+        { "result-cache", optional_argument, NULL, 'R' },
+        { "journal", no_argument, NULL, 'J' },
+        { "resume", no_argument, NULL, 'U' },
+        { "share-prefix", no_argument, NULL, 'P' },
+        { "sections", optional_argument, NULL, 'G' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while((opt = getopt_long(argc, argv, "j:", longopts, NULL)) != -1) {
+        switch(opt) {
+            case 'j':
+                maxjobs = atoi(optarg);
+                if(maxjobs >= 1) break;
+                // fall through
+            default:
+                printf("Usage: ./executeBatchJobs [-j N] [--dry-run] [--spawn=fork|posix] [--plan-cache] [--stats] [--job-timeout=SECS] [--no-fastpath] [--result-cache[=DIR]] [--journal | --resume] [--share-prefix] [--sections[=N]] <file-to-be-executed>\n"
+                       "       ./executeBatchJobs [-j N] [--spawn=fork|posix] [--stats] [--job-timeout=SECS] [--result-cache[=DIR]] --stream[=FIFO] | --serve=SOCKET\n"
+                       "       ./executeBatchJobs --submit=SOCKET <file-to-be-executed>\n");
+                return 0;
+            case 'n':
+                dryrun = 1;
+                break;
+            case 'p':
+                usecache = 1;
+                break;
+            case 'S':
+                stats = 1;
+                break;
+            case 'r':
+                stream = optarg ? optarg : "-";
+                break;
+            case 'F':
+                fastPath = 0;
+                break;
+            case 'L':
+                serve = optarg;
+                break;
+            case 'C':
+                submit = optarg;
+                break;
+            case 'R':
+                resultcache = optarg ? optarg : CACHE_DIR;
+                break;
+            case 'J':
+                if(journal == 0) journal = 1;
+                break;
+            case 'U':
+                journal = 2;
+                break;
+            case 'P':
+                shareprefix = 1;
+                break;
+            case 'G':
+                sections = optarg ? atoi(optarg) : sysconf(_SC_NPROCESSORS_ONLN);
+                if(sections >= 1) break;
+                printf("--sections needs a number of sections of at least 1\n");
+                return 0;
+            case 't':
+                timeout = atof(optarg);
+                if(timeout < 0) timeout = 0;
+                break;
+            case 's':
+                if(strcmp(optarg, "fork") == 0) spawnBackend = SPAWN_FORK;
+                else if(strcmp(optarg, "posix") == 0) spawnBackend = SPAWN_POSIX;
+                else {
+                    printf("Unknown --spawn backend: %s (use fork or posix)\n", optarg);
+                    return 0;
+                }
+                break;
+        }
+    }
 
-    char **args;
+    if(submit) {
+        if(optind != argc - 1) {
+            printf("--submit needs the batch file to send\n");
+            return 0;
+        }
+        if(submitBatch(submit, argv[optind]) < 0) {
+            perror(submit);
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
 
-    int i,j,k;
+    if(resultcache && !dryrun)
+        openCache(resultcache);
 
-    int beginflag = 0;  
-    int endflag = 0;
+    if(serve) {
+        if(optind != argc || dryrun || usecache || stream || stats || journal || shareprefix || sections) {
+            printf("--serve reads the batches from its clients: no batch file, --dry-run, --plan-cache, --stream, --stats, --journal, --share-prefix or --sections (see %%STATUS)\n");
+            return 0;
+        }
 
-    int commentbegin = 0;
-    int commnentend = 0;
+        printf("Serving batches on %s (up to %d lines at a time)\n\n", serve, maxjobs);
+        fflush(stdout);
 
+        initJobs(maxjobs, timeout);
 
-    if(argc != 2) {
-        printf("Usage: ./executeBatchJobs <file-to-be-executed>\n");
-        return 0;
+        // Only returns if the socket can't be set up
+        serveJobs(serve);
+        perror(serve);
+        exit(EXIT_FAILURE);
     }
 
-    printf("Batch file being executed: %s\n\n", argv[1]);
+    if(stream) {
+        if(optind != argc || dryrun || usecache || journal || shareprefix || sections) {
+            printf("--stream reads the batch from stdin or a FIFO: no batch file, --dry-run, --plan-cache, --journal, --share-prefix or --sections\n");
+            return 0;
+        }
 
-    // Readying the OUTPUT.txt using O_TRUNC
-    int fd = open("OUTPUT.txt", O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IRGRP | S_IWGRP |S_IWUSR); // user - r and w permissions. 
-    close(fd);
+        // Opened read-write, a FIFO doesn't reach EOF when its writers go away
+        streamfd = strcmp(stream, "-") == 0 ? STDIN_FILENO : open(stream, O_RDWR | O_CLOEXEC);
+        if(streamfd < 0) {
+            perror(stream);
+            exit(EXIT_FAILURE);
+        }
 
-    fp = fopen(argv[1], "r");
+        printf("Batch being executed from %s\n\n", streamfd == STDIN_FILENO ? "stdin" : stream);
 
-    if (fp == NULL)
-        exit(EXIT_FAILURE);
+        // The lines read /dev/null as stdin, wherever the batch comes from: from stdin, they would eat its next lines
+        if((jobInput = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+            perror("/dev/null");
+            exit(EXIT_FAILURE);
+        }
 
+        initJobs(maxjobs, timeout);
+        if(stats)
+            openStats("OUTPUT.stats.jsonl");
 
-    while(getline(&line, &linesize, fp) != -1) {       
+        // Every line is compiled and started as soon as it is read
+        unterminated = runStream(streamfd, addEntry);
+        finishJobs();
+        closeCache();
 
-        
-        if(strcmp(line, "%BEGIN\n") == 0) {
-            if(beginflag == 0) {
-                beginflag = 1;  // seen begin. Now, we can start processing from the next line.
-                // printf("\nBeginning batch file execution...\n\n");
-                continue;
-            }
+        if(unterminated)
+            printf("\n\nUnable to find matching %%END statement!\n\n");
 
-            else 
-                continue; // ignore all other begins
+        if(stats) {
+            closeStats();
+            printLaunchStats();
         }
 
-        if(beginflag == 0 && strcmp(line, "%END\n") == 0) continue; // %END before seeing a %BEGIN is not valid
-
-        if(beginflag == 1 && endflag == 0) {
-            if(strcmp(line, "%END") == 0 || strcmp(line, "%END\n") == 0) {
-                endflag = 1;   
-                // return 0;
-                
-                // reset both flags
-                beginflag = 0;
-                endflag = 0;
-            }
+        return 0;
+    }
+
+    if(optind != argc - 1) {
+        printf("Usage: ./executeBatchJobs [-j N] [--dry-run] [--spawn=fork|posix] [--plan-cache] [--stats] [--job-timeout=SECS] [--no-fastpath] [--result-cache[=DIR]] [--journal | --resume] [--share-prefix] [--sections[=N]] <file-to-be-executed>\n"
+                       "       ./executeBatchJobs [-j N] [--spawn=fork|posix] [--stats] [--job-timeout=SECS] [--result-cache[=DIR]] --stream[=FIFO] | --serve=SOCKET\n"
+                       "       ./executeBatchJobs --submit=SOCKET <file-to-be-executed>\n");
+        return 0;
+    }
+
+    batchfile = argv[optind];
+
+    printf("Batch file being executed: %s\n\n", batchfile);
+
+    // OUTPUT.txt is truncated and written by the scheduler alone (see output.h).
+    // With --sections, a section has one line in flight at most: the limit is on sections.
+    initJobs(sections ? sections : maxjobs, timeout);
+
+    // Unless an option needs every line before the first one runs, the file is read, compiled
+    // and run like a stream (see stream.h): only the lines in the scheduler's window and the
+    // chunks they were compiled in are in memory, however long the batch is
+    if(!dryrun && !usecache && !shareprefix && !sections) {
+        if((batchfd = open(batchfile, O_RDONLY | O_CLOEXEC)) < 0) {
+            perror(batchfile);
+            exit(EXIT_FAILURE);
         }
 
-        if(beginflag == 1) {
-            args = parseLine(line);
-            
-            
-            // printf("Calling 'execute' with the following as args: ");
-            // for(j = 0; args[j]!=NULL; j++) printf("%s ", args[j]); 
-            // printf("\n");
+        // Read before the lines are added: those it says are done are skipped as they are (see journal.h)
+        if(journal)
+            openJournal(JOURNAL_FILE, journal == 2);
+        if(stats)
+            openStats("OUTPUT.stats.jsonl");
 
-            execute(args);
+        unterminated = runStream(batchfd, addEntry);
+        close(batchfd);
+        finishJobs();
+        closeCache();
+        closeJournal();
 
-            printf("\n\n");
+        if(unterminated)
+            printf("\n\nUnable to find matching %%END statement!\n\n");
 
-            free(args);
+        if(stats) {
+            closeStats();
+            printLaunchStats();
         }
 
+        return 0;
     }
 
+    // Lines are collected into the dependency graph and run once the whole file is read
 
+    // The whole file is mapped, parsed (in parallel for big files) and its sections resolved
+    // up front, or its plan file is loaded instead (see plan.h)
+    if(loadPlan(batchfile, &plan, sysconf(_SC_NPROCESSORS_ONLN), usecache) < 0) {
+        perror(batchfile);
+        exit(EXIT_FAILURE);
+    }
 
-    fclose(fp);
+    // Read before the lines are added: those it says are done are skipped as they are (see journal.h)
+    if(journal && !dryrun)
+        openJournal(JOURNAL_FILE, journal == 2);
+
+    for(i = 0; i < plan.nentries; i++)
+        addEntry(&plan.entries[i]);
+
+    // Needs every line: a line's group is only known once the lines after it are
+    if(shareprefix)
+        shareJobs();
+    if(sections)
+        groupSections(sections);
+
+    if(stats && !dryrun)
+        openStats("OUTPUT.stats.jsonl");
+
+    if(dryrun)
+        printPlan();
+    else
+        runJobs();
+    finishJobs();
+    closeCache();
+    closeJournal();
     
-    if(beginflag == 1 && endflag == 0)
+    if(plan.unterminated)
         printf("\n\nUnable to find matching %%END statement!\n\n");
+
+    if(stats) {
+        closeStats();
+        printLaunchStats();
+    }
+
+    unloadPlan(&plan);
     
     return 0;
 }   
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Runs the batch files generated by gen.sh with the executor and, for comparison, with every
+# line given to /bin/sh -c one after the other. Run from the top of the tree (make bench).
+#
+# BENCH_DIR     where the batch files and their inputs are generated (default bench/work)
+# BENCH_FLAGS   options given to the executor (e.g. "-j 8 --spawn=posix")
+# BENCH_MB      and the other gen.sh variables control the size of the workloads
+#
+# For every batch file, prints the wall time and jobs/sec of both. For the high-volume
+# pipelines, MB/s of input through the pipeline. For latency.batch, the percentiles of the
+# time between the starts of consecutive lines (launch, run and reap of one short command).
+
+set -e
+
+top=$(pwd)
+exe="$top/batchJobExecuter"
+dir=${BENCH_DIR:-bench/work}
+mb=${BENCH_MB:-256}
+
+sh "$top/bench/gen.sh" "$dir"
+cd "$dir"
+
+now() { date +%s%N; }
+
+# Lines of a batch file that are run
+countJobs() { awk '/^%BEGIN$/ { on = 1; next } /^%END$/ { on = 0 } on && !/^%/ { n++ } END { print n + 0 }' "$1"; }
+
+# Runs every line of the batch file with /bin/sh -c, output appended to SH.txt
+runShell() {
+    : > SH.txt
+    awk '/^%BEGIN$/ { on = 1; next } /^%END$/ { on = 0 } on && !/^%/' "$1" | while IFS= read -r line; do
+        /bin/sh -c "$line" >> SH.txt 2>&1
+    done
+}
+
+# Prints "<label> <seconds> <jobs/sec>" from a start and end time in ns
+report() {
+    awk -v label="$1" -v ns=$(($3 - $2)) -v jobs="$4" -v mb="$5" 'BEGIN {
+        s = ns / 1e9
+        line = sprintf("  %-10s %8.3f s %10.1f jobs/s", label, s, jobs / s)
+        if(mb != "") line = line sprintf(" %8.1f MB/s", mb / s)
+        print line
+    }'
+}
+
+# Percentiles of the time between consecutive timestamps (ns, one per line) found in a file
+percentiles() {
+    grep -E '^[0-9]{19}$' "$2" | sort -n | awk 'NR > 1 { print ($1 - prev) / 1000 } { prev = $1 }' | sort -n | awk -v label="$1" '
+        function at(p,  i) { i = int(NR * p + 0.5); return v[i < 1 ? 1 : i] }
+        { v[NR] = $1 }
+        END {
+            if(NR == 0) { print "  " label ": no timestamps"; exit }
+            printf "  %-10s p50 %8.1f us  p90 %8.1f us  p99 %8.1f us  max %8.1f us\n", label, at(0.5), at(0.9), at(0.99), v[NR]
+        }'
+}
+
+for batch in trivial deep redirect sort copy; do
+    jobs=$(countJobs $batch.batch)
+    [ $batch = sort ] || [ $batch = copy ] && volume=$mb || volume=
+
+    echo "$batch.batch ($jobs lines)"
+
+    t0=$(now); "$exe" $BENCH_FLAGS $batch.batch > /dev/null; t1=$(now)
+    report executor $t0 $t1 $jobs $volume
+
+    t0=$(now); runShell $batch.batch; t1=$(now)
+    report "sh -c" $t0 $t1 $jobs $volume
+done
+
+echo "latency.batch ($(countJobs latency.batch) lines, time between consecutive starts)"
+"$exe" $BENCH_FLAGS latency.batch > /dev/null
+percentiles executor OUTPUT.txt
+runShell latency.batch
+percentiles "sh -c" SH.txt
@@ -0,0 +1,157 @@
+#!/bin/sh
+#
+# Regression checks, run from the top of the tree (make check). Every check runs the executor
+# in a scratch directory and prints "ok <name>" or "FAIL <name>: <why>"; the script exits with
+# 1 if any check failed.
+#
+# CHECK_DIR     where the checks run (default bench/check)
+# HEAP_LINES    lines of the long batch the heap check runs (default 1000000)
+
+top=$(pwd)
+exe="$top/batchJobExecuter"
+dir=${CHECK_DIR:-bench/check}
+failed=0
+
+rm -rf "$dir"
+mkdir -p "$dir"
+cd "$dir"
+cp "$top/hello.txt" .
+
+ok() { echo "ok $1"; }
+fail() { echo "FAIL $1: $2"; failed=1; }
+skip() { echo "skip $1: $2"; }
+
+# Blank lines and comments between the commands of a section leave no block, and crash nothing
+check_blank() {
+    for flags in "" "--no-fastpath" "-j 4"; do
+        "$exe" $flags "$top/blanktest" > stdout.txt 2>&1
+        status=$?
+        if [ $status -ne 0 ]; then fail blank "exit status $status with '$flags'"; return; fi
+        if [ $(grep -c '^### line' OUTPUT.txt) -ne 3 ] || grep -q 'signal' OUTPUT.txt; then
+            fail blank "unexpected blocks with '$flags'"
+            return
+        fi
+    done
+    ok blank
+}
+
+# With --stream, a line reading stdin gets nothing, not the lines of the batch that follow it
+check_stream_stdin() {
+    (printf '%%BEGIN\nhead -c 12\necho a\n'; sleep 1; printf 'echo second\necho third\n%%END\n') |
+        "$exe" --stream > stdout.txt 2>&1
+    status=$?
+    if [ $status -ne 0 ]; then fail stream-stdin "exit status $status"; return; fi
+    if [ $(grep -c '^### line' OUTPUT.txt) -ne 4 ] || grep -q 'echo' OUTPUT.txt; then
+        fail stream-stdin "a line read the batch"
+        return
+    fi
+    ok stream-stdin
+}
+
+# A client of --serve with more lines than the window gets all of them back, copies the executor
+# does itself included (they finish as they start, without any event to wait for)
+check_serve() {
+    awk 'BEGIN { print "%BEGIN"; for(i = 1; i <= 100; i++) print "cat hello.txt > copy.txt"; print "%END" }' > serve.batch
+    "$exe" -j 1 --serve="$(pwd)/serve.sock" > server.txt 2>&1 &
+    server=$!
+    sleep 0.5
+
+    timeout 20 "$exe" --submit="$(pwd)/serve.sock" serve.batch > stdout.txt 2>&1
+    status=$?
+    kill $server
+    wait $server 2> /dev/null
+    if [ $status -ne 0 ]; then fail serve "exit status $status"; return; fi
+    if ! grep -q '^### done: 100 lines, 0 failed' stdout.txt; then fail serve "the lines didn't all come back"; return; fi
+    ok serve
+}
+
+# The lines of a --serve client run in the directory it was submitted from: two clients with the
+# same relative names each read and write their own files
+check_serve_cwd() {
+    mkdir -p srv a b
+    echo a > a/name.txt
+    echo b > b/name.txt
+    printf '%%BEGIN\ncat name.txt > copy.txt\ncat copy.txt\n%%END\n' > cwd.batch
+    (cd srv && exec "$exe" -j 2 --serve="$(pwd)/../cwd.sock" > server.txt 2>&1) &
+    server=$!
+    sleep 0.5
+
+    (cd a && timeout 20 "$exe" --submit="$(pwd)/../cwd.sock" ../cwd.batch > stdout.txt 2>&1) &
+    (cd b && timeout 20 "$exe" --submit="$(pwd)/../cwd.sock" ../cwd.batch > stdout.txt 2>&1)
+    wait $!
+    sleep 0.2
+    kill $server
+    wait $server 2> /dev/null
+    if [ -e srv/copy.txt ]; then fail serve-cwd "a line ran in the server's directory"; return; fi
+    for c in a:b b:a; do
+        if ! grep -qx "${c%:*}" ${c%:*}/stdout.txt || grep -qx "${c#*:}" ${c%:*}/stdout.txt; then
+            fail serve-cwd "client ${c%:*} didn't read its own file"
+            return
+        fi
+    done
+    ok serve-cwd
+}
+
+# A line of --result-cache runs again once the program it runs changes, its arguments and files
+# being the same
+check_cache_command() {
+    mkdir -p bin
+    printf '#!/bin/sh\necho v1\n' > bin/tool
+    chmod +x bin/tool
+    printf '%%BEGIN\ntool hello.txt\n%%END\n' > tool.batch
+    PATH="$(pwd)/bin:$PATH" "$exe" --result-cache tool.batch > stdout.txt 2>&1
+    printf '#!/bin/sh\necho v2\n' > bin/tool.new
+    chmod +x bin/tool.new
+    mv bin/tool.new bin/tool
+    PATH="$(pwd)/bin:$PATH" "$exe" --result-cache tool.batch > stdout.txt 2>&1
+    status=$?
+    if [ $status -ne 0 ]; then fail cache-command "exit status $status"; return; fi
+    if ! grep -qx v2 OUTPUT.txt; then fail cache-command "the output of the old program was replayed"; return; fi
+    ok cache-command
+}
+
+# The peak heap of a batch doesn't grow with its length: a 1000-line batch and a HEAP_LINES one
+# are run, and their peaks (bench/heapcount.c) compared. Every 1000th line is a pipeline, which
+# launches the processes the samples are taken at; the others are copies the executor does itself.
+heapBatch() {
+    awk -v n="$1" 'BEGIN {
+        print "%BEGIN"
+        for(i = 1; i <= n; i++) print (i % 1000 == 0 ? "wc -l hello.txt | cat" : "cat hello.txt > copy.txt")
+        print "%END"
+    }' > heap.batch
+
+    rm -f heap.log
+    HEAPCOUNT_LOG="$(pwd)/heap.log" LD_PRELOAD="$(pwd)/heapcount.so" "$exe" heap.batch > stdout.txt 2>&1
+    status=$?
+    if [ $status -ne 0 ]; then echo "exit status $status"; return 1; fi
+    if [ ! -s heap.log ]; then echo "no peak in heap.log"; return 1; fi
+    awk '{ print $2 }' heap.log
+}
+
+check_heap() {
+    lines=${HEAP_LINES:-1000000}
+    if ! gcc -O2 -shared -fPIC -o heapcount.so "$top/bench/heapcount.c" -ldl 2> /dev/null; then
+        skip heap "bench/heapcount.c doesn't build (needs mallinfo2(), glibc 2.33)"
+        return
+    fi
+
+    if ! small=$(heapBatch 1000); then fail heap "$small"; return; fi
+    if ! big=$(heapBatch "$lines"); then fail heap "$big"; return; fi
+
+    echo "heap: peak of $small bytes for 1000 lines, $big for $lines lines"
+    # Slack for the chunks of compiled lines: a sample can find one more arena block in use
+    if [ $((big - small)) -gt 131072 ]; then
+        fail heap "the peak grew by $((big - small)) bytes"
+        return
+    fi
+    ok heap
+}
+
+check_blank
+check_stream_stdin
+check_serve
+check_serve_cwd
+check_cache_command
+check_heap
+
+exit $failed
@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# Generates the synthetic batch files (and their input files) used by bench.sh.
+#
+# Usage: gen.sh <dir>
+#
+# BENCH_JOBS    lines of the trivial and redirection batches (default 10000)
+# BENCH_DEPTH   stages of every deep pipeline (default 12)
+# BENCH_MB      size of the input of the high-volume pipelines, in MB (default 256)
+#
+# Batch files written to <dir>:
+#
+#   trivial.batch   BENCH_JOBS short commands (true, echo, cat, wc, grep, sort on a small file)
+#   deep.batch      BENCH_JOBS / 50 pipelines of BENCH_DEPTH stages
+#   sort.batch      cat big.txt | sort | uniq > sort.out
+#   copy.batch      cat big.txt | cat | cat | cat > copy.out (nothing but data moving through pipes)
+#   redirect.batch  BENCH_JOBS lines alternating '>' and '>>' over 100 files
+#   latency.batch   2000 lines printing the time they were started at (date +%s%N)
+
+set -e
+
+dir=${1:?usage: gen.sh <dir>}
+jobs=${BENCH_JOBS:-10000}
+depth=${BENCH_DEPTH:-12}
+mb=${BENCH_MB:-256}
+
+mkdir -p "$dir"
+cd "$dir"
+
+# Inputs: a small text file, and BENCH_MB of lines with many duplicates (so uniq has work to do)
+awk 'BEGIN { for(i = 0; i < 200; i++) printf "line %d of the small file %s\n", i, (i % 7 ? "" : "x") }' > small.txt
+
+if [ ! -f big.txt ] || [ "$(wc -c < big.txt)" -lt $((mb * 1000000)) ]; then
+    awk -v bytes=$((mb * 1000000)) 'BEGIN {
+        srand(1)
+        while(n < bytes) {
+            line = sprintf("key %08d value %d", int(rand() * 500000), int(rand() * 100))
+            print line
+            n += length(line) + 1
+        }
+    }' > big.txt
+fi
+
+awk -v n="$jobs" 'BEGIN {
+    print "%BEGIN"
+    for(i = 0; i < n; i++) {
+        k = i % 6
+        if(k == 0) print "true"
+        else if(k == 1) print "echo trivial line " i
+        else if(k == 2) print "cat small.txt"
+        else if(k == 3) print "wc -l small.txt"
+        else if(k == 4) print "grep x small.txt"
+        else print "sort small.txt"
+    }
+    print "%END"
+}' > trivial.batch
+
+awk -v n=$((jobs / 50)) -v depth="$depth" 'BEGIN {
+    print "%BEGIN"
+    for(i = 0; i < n; i++) {
+        line = "cat small.txt"
+        for(s = 2; s < depth; s++) line = line " | cat"
+        print line " | wc -l"
+    }
+    print "%END"
+}' > deep.batch
+
+printf '%%BEGIN\ncat big.txt | sort | uniq > sort.out\n%%END\n' > sort.batch
+printf '%%BEGIN\ncat big.txt | cat | cat | cat > copy.out\n%%END\n' > copy.batch
+
+awk -v n="$jobs" 'BEGIN {
+    print "%BEGIN"
+    for(i = 0; i < n; i++) {
+        if(i % 2 == 0) print "echo redirected " i " > out." (i % 100) ".txt"
+        else print "cat small.txt >> out." (i % 100) ".txt"
+    }
+    print "%END"
+}' > redirect.batch
+
+awk 'BEGIN {
+    print "%BEGIN"
+    for(i = 0; i < 2000; i++) print "date +%s%N"
+    print "%END"
+}' > latency.batch
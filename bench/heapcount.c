@@ -0,0 +1,86 @@
+/*
+    LD_PRELOAD shim for the heap check of bench/check.sh:
+        gcc -O2 -shared -fPIC -o heapcount.so bench/heapcount.c -ldl
+
+    Finds the peak heap of the executor: the bytes of heap in use (mallinfo2(), allocated chunks
+    plus mmap()ed ones) are sampled right before every process it launches (fork(), posix_spawn(),
+    posix_spawnp()) and once more at exit, and "<launches> <largest sample>" is appended to the
+    file HEAPCOUNT_LOG at exit. HEAPCOUNT_LOG is taken out of the environment at startup: the
+    commands the executor runs load the shim too, but don't report.
+
+    A batch that launches processes only on some of its lines (the others are copies the
+    executor does itself) samples the heap at these lines.
+*/
+#define _GNU_SOURCE   // for RTLD_NEXT
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <dlfcn.h>
+#include <spawn.h>
+#include <fcntl.h>
+
+static long launches;
+static size_t peak;
+static char *logpath;
+
+static void sample(void) {
+  struct mallinfo2 mi = mallinfo2();
+
+  if(mi.uordblks + mi.hblkhd > peak) peak = mi.uordblks + mi.hblkhd;
+}
+
+__attribute__((constructor))
+static void start(void) {
+  const char *path = getenv("HEAPCOUNT_LOG");
+
+  if(path == NULL) return;
+  logpath = strdup(path);
+  unsetenv("HEAPCOUNT_LOG");
+}
+
+__attribute__((destructor))
+static void report(void) {
+  char line[64];
+  int fd, len;
+
+  sample();
+  if(logpath == NULL) return;
+
+  len = snprintf(line, sizeof(line), "%ld %zu\n", launches, peak);
+  if((fd = open(logpath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) >= 0) {
+    if(write(fd, line, len) < 0) {}
+    close(fd);
+  }
+}
+
+pid_t fork(void) {
+  static pid_t (*next)(void);
+
+  if(next == NULL) next = (pid_t (*)(void))dlsym(RTLD_NEXT, "fork");
+  launches++;
+  sample();
+  return next();
+}
+
+int posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *actions,
+                const posix_spawnattr_t *attr, char *const argv[], char *const envp[]) {
+  static int (*next)(pid_t*, const char*, const posix_spawn_file_actions_t*, const posix_spawnattr_t*, char *const[], char *const[]);
+
+  if(next == NULL) next = (int (*)(pid_t*, const char*, const posix_spawn_file_actions_t*, const posix_spawnattr_t*, char *const[], char *const[]))dlsym(RTLD_NEXT, "posix_spawn");
+  launches++;
+  sample();
+  return next(pid, path, actions, attr, argv, envp);
+}
+
+int posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *actions,
+                 const posix_spawnattr_t *attr, char *const argv[], char *const envp[]) {
+  static int (*next)(pid_t*, const char*, const posix_spawn_file_actions_t*, const posix_spawnattr_t*, char *const[], char *const[]);
+
+  if(next == NULL) next = (int (*)(pid_t*, const char*, const posix_spawn_file_actions_t*, const posix_spawnattr_t*, char *const[], char *const[]))dlsym(RTLD_NEXT, "posix_spawnp");
+  launches++;
+  sample();
+  return next(pid, file, actions, attr, argv, envp);
+}
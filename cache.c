@@ -0,0 +1,273 @@
+#define _GNU_SOURCE   // for O_TMPFILE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// for open() and stat()
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "cache.h"
+#include "execute.h"
+
+// 128-bit FNV-1a: a cache of millions of entries never sees two keys with the same hash
+#define FNV_OFFSET (((unsigned __int128)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL)
+#define FNV_PRIME  (((unsigned __int128)1 << 88) | 0x13b)
+
+// Content hash of a file, remembered for the rest of the run
+struct filehash {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  unsigned __int128 hash;
+  int used;
+};
+
+static char *cachedir;
+static struct filehash *hashes;   // open addressing, keyed by dev and inode
+static int caphashes, nhashes;
+
+static int hits, misses, stored, skipped;
+
+static void *allocOrDie(void *p) {
+  if(!p) {
+    printf("Memory allocation unsuccessful! Exiting...\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+// FNV-1a over len bytes
+static unsigned __int128 hashBytes(unsigned __int128 h, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char*)data;
+  while(len--) {
+    h ^= *p++;
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+// FNV-1a over the 64-bit words of a file's content (then its last bytes), eight times fewer steps than bytes
+static unsigned __int128 hashContent(const char *data, size_t len) {
+  unsigned __int128 h = FNV_OFFSET;
+  uint64_t w;
+  size_t i;
+
+  for(i=0; i + 8 <= len; i += 8) {
+    memcpy(&w, data + i, 8);
+    h ^= w;
+    h *= FNV_PRIME;
+  }
+  return hashBytes(h, data + i, len - i);
+}
+
+void openCache(const char *dir) {
+  if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    perror(dir);
+    exit(EXIT_FAILURE);
+  }
+  cachedir = (char*)allocOrDie(strdup(dir));
+}
+
+int cacheEnabled(void) {
+  return cachedir != NULL;
+}
+
+// Hash of the content of the regular file path (with stat st), computed once per run
+static int fileHash(const char *path, struct stat *st, unsigned __int128 *hash) {
+  struct filehash *old, *f;
+  int oldcap, i, fd;
+  unsigned long h;
+  char *data;
+
+  if(2 * (nhashes + 1) > caphashes) {
+    old = hashes;
+    oldcap = caphashes;
+    caphashes = caphashes ? caphashes * 2 : 64;
+    hashes = (struct filehash*)allocOrDie(calloc(caphashes, sizeof(struct filehash)));
+    for(i=0; i<oldcap; i++) {
+      if(!old[i].used) continue;
+      h = (old[i].ino * 31 + old[i].dev) & (caphashes - 1);
+      while(hashes[h].used) h = (h + 1) & (caphashes - 1);
+      hashes[h] = old[i];
+    }
+    free(old);
+  }
+
+  h = (st->st_ino * 31 + st->st_dev) & (caphashes - 1);
+  for(; hashes[h].used; h = (h + 1) & (caphashes - 1)) {
+    f = &hashes[h];
+    if(f->ino != st->st_ino || f->dev != st->st_dev) continue;
+
+    // Changed since it was hashed (by an earlier line of this run): hashed again
+    if(f->size == st->st_size && f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+      *hash = f->hash;
+      return 0;
+    }
+    break;
+  }
+
+  if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+  if(st->st_size == 0) *hash = FNV_OFFSET;
+  else {
+    data = (char*)mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    *hash = hashContent(data, st->st_size);
+    munmap(data, st->st_size);
+  }
+  close(fd);
+
+  f = &hashes[h];
+  if(!f->used) nhashes++;
+  f->used = 1;
+  f->dev = st->st_dev;
+  f->ino = st->st_ino;
+  f->size = st->st_size;
+  f->mtime = st->st_mtim;
+  f->hash = *hash;
+  return 0;
+}
+
+// Adds what the argument name says about the file it may name to the key
+static int hashFile(unsigned __int128 *key, const char *name) {
+  struct stat st;
+  unsigned __int128 content;
+
+  if(stat(name, &st) < 0) {
+    *key = hashBytes(*key, "-", 1);   // not a file (or not yet)
+    return 0;
+  }
+
+  *key = hashBytes(*key, &st.st_size, sizeof(st.st_size));
+  *key = hashBytes(*key, &st.st_mtim, sizeof(st.st_mtim));
+
+  if(S_ISREG(st.st_mode)) {
+    if(fileHash(name, &st, &content) < 0) return -1;
+    *key = hashBytes(*key, &content, sizeof(content));
+  }
+  else *key = hashBytes(*key, &st.st_ino, sizeof(st.st_ino));
+
+  return 0;
+}
+
+/*
+    Adds the file the command name runs to the key: its path (which PATH resolves it to) and the
+    inode and time of that file, so that a line runs again once its program is rebuilt, upgraded
+    or found elsewhere in PATH.
+*/
+static void hashCommand(unsigned __int128 *key, const char *name) {
+  const char *path = commandPath(name);
+  struct stat st;
+
+  if(path == NULL || stat(path, &st) < 0) {
+    *key = hashBytes(*key, "-", 1);   // fails to start, whatever its arguments
+    return;
+  }
+
+  *key = hashBytes(*key, path, strlen(path) + 1);
+  *key = hashBytes(*key, &st.st_dev, sizeof(st.st_dev));
+  *key = hashBytes(*key, &st.st_ino, sizeof(st.st_ino));
+  *key = hashBytes(*key, &st.st_size, sizeof(st.st_size));
+  *key = hashBytes(*key, &st.st_mtim, sizeof(st.st_mtim));
+}
+
+int cacheKey(char **args, unsigned __int128 *key) {
+  const char *name;
+  int first = 1;    // next argument is the command name of a stage
+  int fanout = 0, redirect = 0;
+  int i;
+
+  *key = FNV_OFFSET;
+
+  for(i=0; args[i] != NULL; i++) {
+    name = args[i];
+    while(name[0] == '.' && name[1] == '/') name += 2;
+    if(strcmp(name, "OUTPUT.txt") == 0) return 0;
+
+    // Every token is part of the key, NUL-terminated so that "a b" and "ab" differ
+    *key = hashBytes(*key, args[i], strlen(args[i]) + 1);
+
+    // The fan-out operators (see struct command) separate stages too
+    if(strcmp(args[i], "|") == 0 || strcmp(args[i], ";") == 0) { first = 1; continue; }
+    if(strcmp(args[i], "|{") == 0) { first = fanout = 1; continue; }
+    if(strcmp(args[i], "}") == 0) continue;
+    if(strcmp(args[i], ">") == 0 || strcmp(args[i], ">>") == 0) {
+      redirect = 1;
+      if(args[i+1] != NULL) {
+        i++;
+        name = args[i];
+        while(name[0] == '.' && name[1] == '/') name += 2;
+        if(strcmp(name, "OUTPUT.txt") == 0) return 0;
+        *key = hashBytes(*key, args[i], strlen(args[i]) + 1);
+      }
+      continue;
+    }
+    if(first) {
+      first = 0;
+      hashCommand(key, args[i]);
+      continue;
+    }
+
+    if(hashFile(key, args[i]) < 0) return 0;
+  }
+
+  // One entry holds one output: the targets of several consumers can't be replayed from it
+  return !(fanout && redirect);
+}
+
+int cacheLookup(unsigned __int128 key) {
+  char path[PATH_MAX];
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%016llx%016llx", cachedir, (unsigned long long)(key >> 64), (unsigned long long)key);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) misses++;
+  else hits++;
+  return fd;
+}
+
+int cacheCreate(void) {
+  // Unnamed until cacheCommit() links it: an interrupted run leaves nothing behind
+  return open(cachedir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+}
+
+void cacheCommit(int fd, unsigned __int128 key, int ok) {
+  char path[PATH_MAX], proc[64];
+
+  if(fd < 0) return;
+
+  if(ok) {
+    snprintf(path, sizeof(path), "%s/%016llx%016llx", cachedir, (unsigned long long)(key >> 64), (unsigned long long)key);
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    if(linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == 0) stored++;
+  }
+  close(fd);
+}
+
+void cacheSkipped(void) {
+  skipped++;
+}
+
+void closeCache(void) {
+  if(cachedir == NULL) return;
+
+  printf("Result cache (%s): %d hits, %d misses, %d results stored, %d lines not cached\n",
+         cachedir, hits, misses, stored, skipped);
+
+  free(cachedir);
+  free(hashes);
+  cachedir = NULL;
+  hashes = NULL;
+  caphashes = nhashes = 0;
+}
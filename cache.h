@@ -0,0 +1,59 @@
+/*
+    Result cache (--result-cache): lines whose inputs haven't changed since an earlier run are
+    not run again, their output is replayed from the cache instead.
+
+    Only for lines whose output depends on nothing but their arguments and the files they name
+    (e.g. "wc -c hello.txt", "sort newhello.txt | uniq"): the cache can't see what else a command
+    reads or does. Lines for which that isn't true (ls, date, anything with side effects such as
+    cp or mkdir) must be preceded by %NOCACHE when the cache is used.
+
+    HOW IT WORKS:
+
+    1. The key of a line is a 128-bit hash (FNV-1a) of its tokens, of the file every command of
+       the line runs (the path PATH resolves it to, and its inode, size and modification time)
+       and, for every argument that names a file (the same arguments the dependency graph
+       takes as inputs, see jobs.h), the size, modification time and content hash of the file
+       (or that it doesn't exist). The content of a file is hashed once per run, however many
+       lines name it.
+    2. The output of a line that exits with status 0 is stored in <dir>/<key>: what it wrote
+       to OUTPUT.txt (its block without the header) or what it added to its '>'/'>>' target.
+       Entries are written to an unnamed file (O_TMPFILE) and linked into the directory once
+       complete, so that a run that is interrupted never leaves a partial entry.
+    3. When a line's key is in the cache, nothing is started: the entry is replayed into the
+       line's block, or written to its target, and the line counts as having exited with 0.
+
+    Not cached: lines inside #INTERSTART/#INTERSTOP (they also write INTER files), lines
+    reading or writing OUTPUT.txt, fan-outs with a '>' or '>>' consumer, lines split by
+    %PARALLEL, and the plain cat lines the executor copies itself.
+    What a cached line wrote to stderr is not stored.
+*/
+
+// Default directory of the cache, in the working directory
+#define CACHE_DIR ".batchcache"
+
+// Turns the cache on, with its entries in dir (created if needed). Exits on failure.
+void openCache(const char *dir);
+
+// Whether openCache() was called
+int cacheEnabled(void);
+
+/*
+    Computes the key of a line from its tokens (as parseLine() returns them) and the files they
+    name. Returns 0 if the line can't be cached (see above).
+*/
+int cacheKey(char **args, unsigned __int128 *key);
+
+// Opens the entry of key for reading. Returns -1 (a miss) if there is none.
+int cacheLookup(unsigned __int128 key);
+
+// Creates a temporary file to store an entry in. Returns its descriptor, or -1.
+int cacheCreate(void);
+
+// Turns the temporary file fd into the entry of key (or removes it, if the entry is not ok), and closes it
+void cacheCommit(int fd, unsigned __int128 key, int ok);
+
+// Counts a line that was not looked up (%NOCACHE, or a line that can't be cached)
+void cacheSkipped(void);
+
+// Prints the hit/miss report and turns the cache off
+void closeCache(void);
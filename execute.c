@@ -1,15 +1,21 @@
+#define _GNU_SOURCE   // for pipe2(), tee() and splice()
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/mman.h>   // for memfd_create()
+#include <poll.h>
 
 
 // for open(), dup() and dup2()
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#define _GNU_SOURCE 
 
 // for tee and splice error checking 
 #include <limits.h>
@@ -17,6 +23,49 @@
 
 #include "parse.h"
 #include "execute.h"
+#include "output.h"
+
+// Records a process started for the job (stage -1 for the helper of an edge capture)
+static void addProcess(struct job *job, pid_t pid, int stage, const char *command) {
+  struct process *p = &job->procs[job->nprocs++];
+
+  memset(p, 0, sizeof(*p));
+  p->pid = pid;
+  p->stage = stage;
+  p->command = command;
+  p->pidfd = -1;
+  clock_gettime(CLOCK_MONOTONIC, &p->start);
+
+  job->nrunning++;
+}
+
+// Process group the processes of the job are started in (NULL if they stay in the executor's)
+#define jobGroup(job) ((job)->flags & JOB_GROUP ? &(job)->pgid : NULL)
+
+// Remembers the target of '>' or '>>' and its size, once opened as fd
+static void setOutfile(struct job *job, const char *path, int fd) {
+  struct stat st;
+
+  job->outfile = path;
+  job->outstart = fstat(fd, &st) == 0 ? st.st_size : 0;
+}
+
+void clearJob(struct job *job) {
+  job->spills = NULL;
+  job->nspills = 0;
+  job->procs = NULL;
+  job->nprocs = 0;
+  job->outfile = NULL;
+  job->outstart = 0;
+  job->nrunning = 0;
+  job->status = 0;
+  job->pgid = 0;
+  job->timedout = 0;
+  job->edges = NULL;
+  job->nedges = 0;
+  job->shards = 0;
+  job->shardstages = 0;
+}
 
 // returns the length of the array of arguments
 int argsLength(char **args) {
@@ -51,6 +100,8 @@ int numberOfPipes(char **args) {
 
     IMPORTANT NOTE: For correct parsing, all input in the batch file is assumed to have correct (non-built in functions only) input, separated by spaces.
 
+    lineno is the line number of the line in the batch file, flags a combination of the JOB_ flags (execute.h).
+
     HOW IT WORKS:
 
     1. Get the length of the arguments array (i.e., no of arguments)
@@ -77,175 +128,571 @@ int numberOfPipes(char **args) {
 
 */
 
-int execute(char** args) {
+int execute(char** args, int lineno, int flags) {
+
+    struct job job;
+    struct arena arena = { NULL };
+
+    job.lineno = lineno;
+    job.flags = flags;
+    job.arena = &arena;
+    job.infd = -1;
+    job.sharefd = -1;
+
+    // To redirect the output of the command to the OUTPUT.txt file (when there
+    // is no '>' or '>>'), the job is handed a descriptor to it.
+    job.outfd = open("OUTPUT.txt", O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP |S_IWUSR); // user - r and w permissions. 
+    if(job.outfd < 0) {
+      perror("OUTPUT.txt");
+      return 0;
+    }
 
-    pid_t pid, wpid;
+    startJob(args, &job);
+    waitJob(&job);
 
-    int status; 
+    close(job.outfd);
+    arenaFree(&arena);
+
+    return 1;
+
+}
+
+/*
+    Starts all the processes for one line without waiting for them.
+    See execute() for how the three cases are handled.
+*/
+int startJob(char** args, struct job *job) {
+  struct command cmd;
+
+  compileCommand(args, &cmd, job->arena);
+  return startCommand(&cmd, job);
+}
+
+// Copies args[from..to) into a NULL-terminated array of arena a
+static char **subArgs(char **args, int from, int to, struct arena *a) {
+  char **sub = (char**)arenaAlloc(a, (to - from + 1) * sizeof(char*));
+
+  memcpy(sub, args + from, (to - from) * sizeof(char*));
+  sub[to - from] = NULL;
+  return sub;
+}
+
+/*
+    Splits a fan-out line (see struct command): what comes before FANOUT_OPEN is the producer,
+    every part between FANOUT_NEXT tokens up to FANOUT_CLOSE a consumer, each compiled on its own.
+*/
+static void compileFanout(char **args, int open, struct command *cmd, struct arena *a) {
+  int len = argsLength(args);
+  int i, start, n = 1;
+
+  compileCommand(subArgs(args, 0, open, a), cmd, a);
+  cmd->redirect = REDIRECT_NONE;    // the producer's output goes to the consumers
+  cmd->redirectfile = NULL;
+
+  for(i=open+1; i<len && strcmp(args[i], FANOUT_CLOSE) != 0; i++)
+    if(strcmp(args[i], FANOUT_NEXT) == 0) n++;
+
+  cmd->branches = (struct command*)arenaAlloc(a, n * sizeof(struct command));
+  cmd->nbranches = 0;
+
+  for(start = i = open + 1; ; i++) {
+    if(i < len && strcmp(args[i], FANOUT_NEXT) != 0 && strcmp(args[i], FANOUT_CLOSE) != 0) continue;
+    if(i > start)   // empty consumers are skipped
+      compileCommand(subArgs(args, start, i, a), &cmd->branches[cmd->nbranches++], a);
+    if(i == len || strcmp(args[i], FANOUT_CLOSE) == 0) break;
+    start = i + 1;
+  }
+
+  if(cmd->nbranches == 0) cmd->branches = NULL;
+}
+
+/*
+    Iterates through the arguments once to find the positions of the operators, then splits
+    them into the commands of the pipeline (see execute()).
+*/
+void compileCommand(char **args, struct command *cmd, struct arena *a) {
 
     int len = 0;    // length of the argument list (including |, > and >> operators)
 
     int i = 0;      
-    int io_counter = 0;
 
     int op1 = 0;      // to mark pos of ">"
     int op2 = 0;     // to mark pos of ">>"
     int opPipe = 0;        // to mark pos of "|"
 
-    int out_fd;
-    int out;
-
     len = argsLength(args);
 
+    cmd->branches = NULL;
+    cmd->nbranches = 0;
+
+    // Case: fan-out. The producer and each consumer are compiled like lines of their own
+    for(i=1;i<len;i++) {
+        if(strcmp(args[i], FANOUT_OPEN) == 0) {
+          compileFanout(args, i, cmd, a);
+          return;
+        }
+    }
+
     for(i=0;i<len;i++) {
         if(strcmp(args[i], ">") == 0) { op1=i; }       // pos of ">"
         else if(strcmp(args[i], ">>") == 0) { op2=i; }   // pos of ">>"
         else if(strcmp(args[i], "|") == 0) { opPipe=i; }       // pos of "|"
     }
 
-    //Case: No |, > or >> operator. Redirect output to OUTPUT.txt
+    cmd->redirect = op1 != 0 ? REDIRECT_TRUNC : op2 != 0 ? REDIRECT_APPEND : REDIRECT_NONE;
+    cmd->redirectfile = NULL;
+
+    //Case: No |, > or >> operator. The whole line is the command.
     if(op1 == 0 && op2 == 0 && opPipe == 0) {
-        
-      if((pid = fork()) < 0) 
-        perror("Fork error");
+      cmd->nstages = 1;
+      cmd->stages = (char***)arenaAlloc(a, sizeof(char**));
+      cmd->stages[0] = args;
+    }
 
-      else if(pid == 0) {
-        // Child. Execute command here
+    // Case: '>' operator found or '>>' found. The command ends at the operator, the file follows it
+    else if(opPipe == 0) {
+      i = op1 != 0 ? op1 : op2;
 
-        // To redirect the output of exec command to the OUTPUT.txt file,
-        // dup(2) is used. This duplicates the file descriptor.
-        int fd = open("OUTPUT.txt", O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IRGRP | S_IWGRP |S_IWUSR); // user - r and w permissions. 
-        
+      cmd->nstages = 1;
+      cmd->stages = (char***)arenaAlloc(a, sizeof(char**));
+      cmd->stages[0] = (char**)arenaAlloc(a, (i + 1) * sizeof(char*));
+      memcpy(cmd->stages[0], args, i * sizeof(char*));
+      cmd->stages[0][i] = NULL;
+      cmd->redirectfile = args[i + 1];
+    }
 
-        dup2(fd, 1);    // to make stdout go to file. (1 is the file descriptor for stdout)
-        dup2(fd, 2);    // to make stderr go to file. (2 is the file descriptor for stderr)
-        close(fd); 
+    // Case: '|' operator is present. 
+    // Parse the commands separated by pipes and add them to the array of commands
+    else {
 
-        printf("\n\n");
-        execvp(args[0], args);
-        printf("Couldn't execute this command\n");
-      }
+      int n = numberOfPipes(args);
 
-      else {
-        // wait for the child in parent process
-        do {
-          wpid = waitpid(pid, &status, 0);
-        } while(!WIFEXITED(status) && !WIFSIGNALED(status));
+      int j;
+      int curoffset = 0;
+      int k = 0;
+
+      cmd->nstages = n + 1;
+      cmd->stages = (char***)arenaAlloc(a, (n + 1) * sizeof(char**));
+
+      while (k<n+1) {
+
+          cmd->stages[k] = (char**)arenaAlloc(a, (len + 1) * sizeof(char*));
+
+          j = 0;
+          while(curoffset < len && strcmp(args[curoffset],"|") != 0 && strcmp(args[curoffset], ">") != 0 && strcmp(args[curoffset], ">>") != 0) {
+            cmd->stages[k][j] = args[curoffset];
+            curoffset = curoffset + 1;
+            j = j + 1;
+          }
+          
+          cmd->stages[k][j] = NULL;
+
+          k = k + 1;
+          curoffset = curoffset + 1;
 
       }
 
+      if(op1 || op2)
+        cmd->redirectfile = args[len - 1];
     }
 
-    // Case: '>' operator found or '>>' found. Redirect to appropriate file following the operator
-    else if( (op1 != 0 || op2 != 0) && opPipe == 0) {
-
-      if((pid = fork()) < 0) 
-        perror("Fork error");
-
-      else if(pid == 0) {
-        //child
-        if (op1 != 0) {
-
-          // '>' operator
-          args[op1] = NULL; // must make that pos NULL so that command can execute correctly
-          /*
-          // Use the out file descriptor to redirect the output
-          // It must be write-only, 
-          // Has to be created if it doesn't exist,
-          // Must be truncated each time it's opened for writing
-          // Give appropriate permissions
-          */
-          out_fd = open(args[op1 + 1], O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IRGRP | S_IWGRP |S_IWUSR);
-        
-        }
+}
 
-        else {
-          // '>>' operator
-          args[op2] = NULL;
-          out_fd = open(args[op2 + 1], O_CREAT | O_APPEND | O_WRONLY, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
-        }
+static void startFanout(struct command *cmd, struct job *job);
+static void startShared(struct command *cmd, struct job *job);
+
+int startCommand(struct command *cmd, struct job *job) {
+
+    pid_t pid;
+    int out_fd;
+
+    clearJob(job);
+
+    // Case: fan-out. One producer feeding several consumers
+    if(cmd->nbranches > 0) {
+      startFanout(cmd, job);
+    }
+
+    // Case: the leading stages of the line were run by another line, whose output it reads
+    else if(job->infd >= 0) {
+      startShared(cmd, job);
+    }
+
+    //Case: No |, > or >> operator. Redirect output to OUTPUT.txt
+    else if(cmd->nstages == 1 && cmd->redirect == REDIRECT_NONE) {
+
+      job->procs = (struct process*)arenaAlloc(job->arena, sizeof(struct process));
+
+      // Blank lines separating the output of each command. Written by the parent
+      // so that they don't depend on the buffering state inherited by the child.
+      write(job->outfd, "\n\n", 2);
 
+      // stdout and stderr of the command both go to the job's output
+      pid = launchCommand(cmd->stages[0], jobInput, job->outfd, job->outfd, jobGroup(job));
+      if(pid > 0)
+        addProcess(job, pid, 0, cmd->stages[0][0]);
 
-        // replace stdout with this out_fd
-        dup2(out_fd, 1);  // 1 equivalent to STDOUT_FILENO
-        close(out_fd);
+    }
 
-        printf("\n\n");
-        execvp(args[0], args);
-        printf("Couldn't execute this command\n");
+    // Case: '>' operator found or '>>' found. Redirect to appropriate file following the operator
+    else if(cmd->nstages == 1) {
+
+      if (cmd->redirect == REDIRECT_TRUNC) {
+
+        // '>' operator
+        /*
+        // Use the out file descriptor to redirect the output
+        // It must be write-only, 
+        // Has to be created if it doesn't exist,
+        // Must be truncated each time it's opened for writing
+        // Give appropriate permissions
+        */
+        out_fd = open(cmd->redirectfile, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP |S_IWUSR);
+      
       }
 
       else {
-        //parent
-        do {
-          wpid = waitpid(pid, &status, 0);
-        } while(!WIFEXITED(status) && !WIFSIGNALED(status));
+        // '>>' operator
+        out_fd = open(cmd->redirectfile, O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+      }
+
+      if(out_fd < 0) {
+        perror(cmd->redirectfile);
+        return 0;
       }
 
+      job->procs = (struct process*)arenaAlloc(job->arena, sizeof(struct process));
+      setOutfile(job, cmd->redirectfile, out_fd);
+
+      write(out_fd, "\n\n", 2);
+
+      pid = launchCommand(cmd->stages[0], jobInput, out_fd, STDERR_FILENO, jobGroup(job));
+
+      close(out_fd);
+
+      if(pid > 0)
+        addProcess(job, pid, 0, cmd->stages[0][0]);
+
     }
 
     // Case: '|' operator is present. 
     // Now, modified to handle multiple pipes using executePipeCommands function.
-    else if(opPipe != 0) {
+    else {
 
-      int n = numberOfPipes(args);
+      executePipeCommands(cmd->stages, cmd->nstages, cmd->redirect == REDIRECT_TRUNC, cmd->redirect == REDIRECT_APPEND, cmd->redirectfile, job);
 
-      // // DEBUG
-      // printf("numberOfPipes = %d\n", n);
+      // ---- BEGIN OF COMMENT --- (DOUBT: Check why this does not work. Some problem with using the same pipe? Unable to pin point the error in the previous code)
 
-      char **commands[n+1];   // An array of commands after splitting on '|' operator
+      // Pasted the code in notes.txt
 
-      int j;
-      int curoffset = 0;
-      int k = 0;
+      // --- END OF COMMENT ----------------
 
-      // Parse the commands separated by pipes and add them to the commands array
-      while (k<n+1) {
+    }
 
-          commands[k] = (char**)malloc(len * sizeof(char*));
-          if(!commands[k]) exit(EXIT_FAILURE);
+    return job->nrunning;
 
-          j = 0;
-          while(curoffset < len && strcmp(args[curoffset],"|") != 0 && strcmp(args[curoffset], ">") != 0 && strcmp(args[curoffset], ">>") != 0) {
-            commands[k][j] = args[curoffset];
-            curoffset = curoffset + 1;
-            j = j + 1;
-          }
-          
-          commands[k][j] = NULL;
-          
-          // // DEBUG
-          // int newlen = argsLength(commands[k]);
-          // for(i=0; i<newlen; i++) {
-          //   printf("%s ", commands[k][i]);
-          // }
+}
 
-          // printf("\n");
+int fastPath = 1;
 
-          k = k + 1;
-          curoffset = curoffset + 1;
+// "./x" and "x" are the same file
+static const char *fileName(const char *name) {
+  while(name[0] == '.' && name[1] == '/') name += 2;
+  return name;
+}
+
+int isCopyCommand(struct command *cmd) {
+  char **argv;
+  int i;
+
+  // A line without tokens (blank, or a comment only) is no command at all
+  if(cmd->nstages < 1 || cmd->stages == NULL || (argv = cmd->stages[0]) == NULL || argv[0] == NULL) return 0;
+
+  if(!fastPath || cmd->nstages != 1 || cmd->nbranches != 0 || strcmp(argv[0], "cat") != 0 || argv[1] == NULL) return 0;
+
+  for(i=1; argv[i] != NULL; i++) {
+    // Options and stdin ("-") are left to cat, and so is OUTPUT.txt, which the executor is writing
+    if(argv[i][0] == '-' || strcmp(fileName(argv[i]), "OUTPUT.txt") == 0) return 0;
+    if(cmd->redirect != REDIRECT_NONE && strcmp(fileName(argv[i]), fileName(cmd->redirectfile)) == 0) return 0;
+  }
+
+  return 1;
+}
+
+int *openCopy(struct command *cmd, struct job *job) {
+  char **files = cmd->stages[0] + 1;
+  int n = argsLength(files);
+  int *fds = (int*)arenaAlloc(job->arena, (n + 1) * sizeof(int));
+  struct stat st;
+  int i;
+
+  clearJob(job);
+
+  // The target is opened before the files, as for cat. '>>' is not O_APPEND here, which
+  // copy_file_range() refuses: runCopy() writes at the end itself.
+  fds[n] = -1;
+  if(cmd->redirect != REDIRECT_NONE) {
+    fds[n] = open(cmd->redirectfile, O_WRONLY | O_CREAT | O_CLOEXEC | (cmd->redirect == REDIRECT_TRUNC ? O_TRUNC : 0), S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+    if(fds[n] < 0) {
+      perror(cmd->redirectfile);
+      job->status = 127 << 8;   // as when nothing could be started
+      return NULL;
+    }
+    setOutfile(job, cmd->redirectfile, fds[n]);
+  }
+
+  // Whatever fails now (even a directory, which opens but can't be read) is known before the header is written
+  for(i=0; i<n; i++) {
+    fds[i] = open(files[i], O_RDONLY | O_CLOEXEC);
+    if(fds[i] >= 0 && fstat(fds[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      close(fds[i]);
+      fds[i] = -EISDIR;
+    }
+    else if(fds[i] < 0) fds[i] = -errno;
+    if(fds[i] < 0) job->status = 1 << 8;
+  }
+
+  return fds;
+}
+
+// Writes s to out (at *off if off isn't NULL)
+static void putString(int out, off_t *off, const char *s) {
+  size_t len = strlen(s);
+  ssize_t w;
+
+  if(off == NULL || *off < 0) {
+    write(out, s, len);
+    return;
+  }
+  if((w = pwrite(out, s, len, *off)) > 0) *off += w;
+}
+
+size_t runCopy(struct command *cmd, struct job *job, int *fds, int out, off_t *off) {
+  char **files = cmd->stages[0] + 1;
+  int n = argsLength(files);
+  int err = out;      // where cat's messages go: its output, or stderr when it is redirected
+  off_t end;
+  ssize_t copied;
+  size_t total = 0;
+  char msg[PATH_MAX + 128];
+  struct stat in, target;
+  int i;
+
+  if(fds[n] >= 0) {
+    out = fds[n];
+    err = STDERR_FILENO;
+    off = &end;
+    end = job->outstart;
+    if(fstat(out, &target) < 0) target.st_ino = 0;
+  }
+  else target.st_ino = 0;
+
+  putString(out, off, "\n\n");
+
+  for(i=0; i<n; i++) {
+    if(fds[i] >= 0 && target.st_ino != 0 && fstat(fds[i], &in) == 0 && in.st_ino == target.st_ino && in.st_dev == target.st_dev) {
+      close(fds[i]);
+      fds[i] = -EINVAL;
+      snprintf(msg, sizeof(msg), "cat: %s: input file is output file\n", files[i]);
+      putString(err, err == out ? off : NULL, msg);
+      job->status = 1 << 8;
+      continue;
+    }
 
+    if(fds[i] >= 0) {
+      copied = copyData(fds[i], out, off);
+      close(fds[i]);
+      if(copied >= 0) {
+        total += copied;
+        continue;
       }
-      
-      if(op1 || op2)
-        {
-          // printf("1\n");
-          executePipeCommands(commands, n+1, op1, op2, args[len - 1]);
-        }
-      else
-        executePipeCommands(commands, n+1, op1, op2, NULL);
+      fds[i] = -errno;
+    }
 
+    snprintf(msg, sizeof(msg), "cat: %s: %s\n", files[i], strerror(-fds[i]));
+    putString(err, err == out ? off : NULL, msg);
+    job->status = 1 << 8;
+  }
 
-      // ---- BEGIN OF COMMENT --- (DOUBT: Check why this does not work. Some problem with using the same pipe? Unable to pin point the error in the previous code)
+  if(fds[n] >= 0) close(fds[n]);
 
-      // Pasted the code in notes.txt
+  return total;
+}
 
-      // --- END OF COMMENT ----------------
+// Stops watching one edge
+static void closeEdge(struct edge *e) {
+  if(e->fd >= 0) close(e->fd);
+  e->fd = -1;
+}
+
+void closeEdges(struct job *job) {
+  int i;
+  for(i=0; i<job->nedges; i++) closeEdge(&job->edges[i]);
+}
+
+// The process reading an edge is reaped: the executor mustn't keep the pipe open on its behalf
+static void stageReaped(struct job *job, struct process *p) {
+  int i;
+
+  for(i=0; i<job->nedges; i++)
+    if(job->edges[i].stage + 1 == p->stage) closeEdge(&job->edges[i]);
+  if(job->nrunning == 0) closeEdges(job);
+}
+
+void stageExited(struct job *job, struct process *p) {
+  char path[64], line[128];
+  long long wchar;
+  FILE *fp;
+  int i;
+
+  for(i=0; i<job->nedges; i++) {
+    if(job->edges[i].stage != p->stage) continue;
+
+    // The counters of an exited process stay readable until it is reaped
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)p->pid);
+    if((fp = fopen(path, "re")) == NULL) return;
+    while(fgets(line, sizeof(line), fp))
+      if(sscanf(line, "wchar: %lld", &wchar) == 1) job->edges[i].wrote = wchar;
+    fclose(fp);
+    return;
+  }
+}
+
+// Remembers that the pipes written by command need size bytes (see newEdge())
+static void pipeGrew(const char *command, int size);
+
+static int newEdge(struct job *job, int stage, const char *command, int pipefd[2]);
+
+int sampleEdges(struct job *job) {
+  struct edge *e;
+  int queued, size;
+  int i, n = 0;
+
+  for(i=0; i<job->nedges; i++) {
+    e = &job->edges[i];
+    if(e->fd < 0 || ioctl(e->fd, FIONREAD, &queued) < 0) continue;
+    n++;
+
+    // Full up to its last page: the writer can't go on until the reader catches up
+    if(queued + 4096 <= e->size) continue;
+    e->stalled += EDGE_SAMPLE_MS;
 
+    if(e->size < EDGE_MAX_SIZE && (size = fcntl(e->fd, F_SETPIPE_SZ, e->size * 2)) > e->size) {
+      e->size = size;
+      e->grown++;
+      pipeGrew(e->command, size);
     }
+  }
 
-    return 1;
+  return n;
+}
+
+// Status of a %PARALLEL line once every process is reaped (see startParallel() in execute.h)
+static int shardStatus(struct job *job) {
+  struct process *p;
+  int merge = job->shards * job->shardstages;   // stage of the merge
+  int error = -1, zero = 0, one = -1;
+  int i, s;
+
+  if(!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0) return job->status;
+
+  for(i=0; i<job->nprocs; i++) {
+    p = &job->procs[i];
+    if(p->stage < 0 || p->stage >= merge || p->stage % job->shardstages != job->shardstages - 1) continue;
+
+    s = p->status;
+    if(WIFEXITED(s) && WEXITSTATUS(s) == 0) zero = 1;
+    else if(WIFEXITED(s) && WEXITSTATUS(s) == 1) { if(one < 0) one = s; }
+    else if(error < 0) error = s;
+  }
+
+  if(error >= 0) return error;
+  if(zero || one < 0) return job->status;
+  return one;
+}
+
+/*
+    Records that pid (one of the job's processes) has been reaped with the given wait status.
+    Returns 1 once every process of the job has been reaped.
+*/
+int jobReaped(struct job *job, pid_t pid, int status, struct rusage *usage) {
+  struct process *p;
+  int i;
+
+  for(i=0; i<job->nprocs; i++) {
+    p = &job->procs[i];
+    if(p->pid == pid && !p->reaped) {
+      // The status of a line is the status of its last command
+      if(i == job->nprocs - 1) job->status = status;
+      p->reaped = 1;
+      p->status = status;
+      p->usage = *usage;
+      clock_gettime(CLOCK_MONOTONIC, &p->end);
+      job->nrunning--;
+      stageReaped(job, p);
+      break;
+    }
+  }
+
+  if(job->nrunning == 0 && job->shards > 0) job->status = shardStatus(job);
+
+  return job->nrunning == 0;
+}
+
+/*
+    Waits for every process of the job.
+*/
+void waitJob(struct job *job) {
+  int i;
+  int status;
+  struct rusage usage;
+
+  // The stages are reaped in order, not as they exit: a writer must not wait for a reader
+  // that has exited but is not reaped yet, because of the executor's copy of their pipe
+  closeEdges(job);
+
+  for(i=0; i<job->nprocs; i++) {
+    if(job->procs[i].reaped) continue;
+    while(wait4(job->procs[i].pid, &status, 0, &usage) < 0) {
+      if(errno != EINTR) break;
+    }
+    jobReaped(job, job->procs[i].pid, status, &usage);
+  }
 
+  // The outputs of the fan-out consumers after the first one, in order
+  for(i=0; i<job->nspills; i++) {
+    if(lseek(job->spills[i], 0, SEEK_SET) == 0) copyData(job->spills[i], job->outfd, NULL);
+    close(job->spills[i]);
+  }
+  job->nspills = 0;
+}
+
+/*
+    If argv is "cat <file>" (fast path only, see isCopyCommand()), opens the file and returns its
+    descriptor. Returns -1 for anything else, and when the file can't be read: cat then runs
+    after all, so that its message and exit status are the usual ones.
+*/
+static int openLeadingCat(char **argv) {
+  struct command cmd;
+  struct stat st;
+  int fd;
+
+  if(argv == NULL || argv[0] == NULL) return -1;
+
+  cmd.stages = &argv;
+  cmd.nstages = 1;
+  cmd.redirect = REDIRECT_NONE;
+  cmd.redirectfile = NULL;
+  cmd.branches = NULL;
+  cmd.nbranches = 0;
+  if(!isCopyCommand(&cmd) || argv[2] != NULL) return -1;
+
+  if((fd = open(argv[1], O_RDONLY | O_CLOEXEC)) < 0) return -1;
+  if(fstat(fd, &st) < 0 || S_ISDIR(st.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
 }
 
 /*
@@ -255,285 +702,1185 @@ int execute(char** args) {
     op1             :   pos of '>' ; indicates presence of '>'
     op2             :   pos of '>>' ; indicates presence of '>>'
     redirectfile    :   filename to be used in case of redirection
+    job             :   job the started processes are added to (its outfd is used when there is no redirection)
 
     HOW IT WORKS:
 
-    Iterate through all commands from left to right and use pipe()
-    and dup2() to redirect input and output.
+    Iterate through all commands from left to right, creating a pipe() for every
+    edge between two stages.
 
     fin is descriptor for input
     fout is descriptor for output
 
     According to the commands, we modify fin and fout.
 
-    To execute each command, we use a fork() call and child executes the command.
+    Every stage is started with launchCommand() before any of them is waited on,
+    so all stages run concurrently and data streams through the pipes. The parent
+    closes its copy of each pipe end right after handing it to the child; only then
+    does a reader see EOF when its writer exits. The function returns once all
+    stages are running; the caller reaps the whole group (waitJob()).
+
+    The executor's own stdin/stdout are never modified: the fds are only
+    dup2()-ed inside the children.
     
 */
-void executePipeCommands(char **commands[], int n, int op1, int op2, char *redirectfile) {
+void executePipeCommands(char **commands[], int n, int op1, int op2, char *redirectfile, struct job *job) {
 
-  int fin, fout;  
-  int pid, wpid;
-  int status;
-  int len;
-  fin = dup(0); // initially fin is a copy of stdin.
-
-  int i,j,k;
-
-  // DEBUG
-  // printf("Inside executePipeCommands:\n");
-  // for(i=0; i<n; i++)
-  // {
-  //   len = argsLength(commands[i]);
-  //   // for(j = 0; j<len; j++) printf("%s ", commands[i][j]);
-  //   //   printf("\n");
-  //   printf("%s (%s)\n", commands[i][len - 2], commands[i][len - 1]);
-  // }
-  // if(op1)
-  //   printf("RedirectFile: %s ",redirectfile);
+  int fin, fout;      // input and output descriptors of the stage being launched
+  int nextin = -1;    // read end of the pipe feeding the next stage
+  int pipefd[2];
+  pid_t pid;
+  int i;
 
-  for(i=0; i<n; i++) {
+  job->procs = (struct process*)arenaAlloc(job->arena, 2 * n * sizeof(struct process));   // one per stage and per captured edge
+  job->edges = (struct edge*)arenaAlloc(job->arena, n * sizeof(struct edge));
+  job->nedges = 0;
 
-    dup2(fin, 0);
-    close(fin);
+  fin = jobInput; // the first stage reads the executor's stdin, or /dev/null (see execute.h)
+  i = 0;
+
+  // A leading "cat <file>" only copies the file into the first pipe: the second stage
+  // reads the file itself instead, one process and one copy fewer. (Not inside
+  // #INTERSTART/#INTERSTOP, where the first edge is copied to INTER.<line>.1.txt.)
+  if(n > 1 && !(job->flags & JOB_INTER) && (nextin = openLeadingCat(commands[0])) >= 0) {
+    fin = nextin;
+    i = 1;
+  }
+
+  for(; i<n; i++) {
 
     if(i == n-1) {
       // If it's the last command, check where the OUTPUT must be redirected
  
       if(op1 != 0) {
-        fout = open(redirectfile, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+        fout = open(redirectfile, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
       }
       else if(op2 != 0) {
-        fout = open(redirectfile, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+        fout = open(redirectfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
       }
       else {
-        // No redirectio. So, use OUTPUT.txt
-        fout = open("OUTPUT.txt", O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IRGRP | S_IWGRP |S_IWUSR); 
+        // No redirectio. So, use the job's output (OUTPUT.txt)
+        fout = fcntl(job->outfd, F_DUPFD_CLOEXEC, 0);
       }
+
+      if(fout < 0) {
+        perror(op1 || op2 ? redirectfile : "OUTPUT.txt");
+        break;
+      }
+
+      if(op1 || op2) setOutfile(job, redirectfile, fout);
     }
 
     else {
       // Use pipe for everything in between. 
-      int pipefd[2];
-      pipe(pipefd);
-      fin = pipefd[0];
+      // O_CLOEXEC keeps the ends of this pipe out of every other stage: only the
+      // two stages it connects get it (through dup2 in launchCommand).
+      if(newEdge(job, i, commands[i][0], pipefd) < 0) {
+        perror("Pipe error");
+        break;
+      }
       fout = pipefd[1];
+      nextin = pipefd[0];
     }
 
-    dup2(fout, 1);
+    pid = launchCommand(commands[i], fin, fout, STDERR_FILENO, jobGroup(job));
+    if(pid > 0)
+      addProcess(job, pid, i, commands[i][0]);
+    else if(job->nedges > 0 && job->edges[job->nedges - 1].stage == i - 1)
+      closeEdge(&job->edges[job->nedges - 1]);   // nobody reads the edge: its writer must get SIGPIPE
+
+    // The child holds its own copies now. Closing ours is what lets the
+    // reader of each pipe see EOF once its writer exits.
+    if(fin != jobInput) close(fin);
     close(fout);
 
-    if((pid = fork()) < 0) 
-      perror("Fork error");
+    fin = nextin;
 
-    else if(pid == 0) {
-      // child
-      execvp(commands[i][0], commands[i]);
-      printf("Couldn't execute this command\n");
-    }
+    // Inside #INTERSTART/#INTERSTOP, the data on this edge is also copied to a file
+    if(i < n-1 && (job->flags & JOB_INTER))
+      fin = captureEdge(job, i+1, fin);
+  }
 
-    else {
-      // parent
-      do {
-          wpid = waitpid(pid, &status, 0);
-        } while(!WIFEXITED(status) && !WIFSIGNALED(status));
+  // Setting up a stage failed half-way: don't leave the read end of the
+  // last pipe open, or the stage before it may block on a full pipe forever
+  if(i < n && i > 0) {
+    close(fin);
+    if(job->nedges > 0) closeEdge(&job->edges[job->nedges - 1]);
+  }
 
-    }
+  // Every stage is running at this point; the caller reaps the whole group
+  // (see waitJob() and jobReaped()).
+
+}
+
+/*
+  Resolved-executable cache.
 
+  execvp() searches PATH in the child, trying execve() in every directory until one works:
+  every launch of "sort" pays for the failed attempts again. The executor instead looks up each
+  command name in PATH once (stat() of every candidate, in the parent), keeps the absolute path
+  in a hash table and hands it to execve() / posix_spawn().
+
+  The table remembers the PATH it was filled with, and is emptied when PATH changes. Names that
+  contain a '/' are not looked up, like in execvp(). If execve() of a cached path fails (e.g. the
+  file was removed, or it is a script without "#!"), the child falls back to execvp().
+*/
+struct resolved {
+  char *name;       // command name, NULL for a free entry
+  char *path;       // absolute path, NULL if the name is not in PATH
+  int pipesize;     // capacity the last pipe written by the command ended up with (0: default)
+};
+
+static struct resolved *resolvedtable;  // open addressing, keyed by command name
+static int capresolved, nresolved;
+static char *resolvedpath;              // PATH the table was filled with
+
+struct launchstats launchStats;
+
+static void *allocOrDie(void *p) {
+  if(!p) {
+    printf("Memory allocation unsuccessful! Exiting...\n");
+    exit(EXIT_FAILURE);
   }
+  return p;
+}
 
+// FNV-1a
+static unsigned long hashName(const char *s) {
+  unsigned long h = 14695981039346656037UL;
+  while(*s) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211UL;
+  }
+  return h;
 }
 
+// Searches the directories of path for an executable regular file called name, like execvp()
+static char *searchPath(const char *name, const char *path) {
+  char candidate[PATH_MAX];
+  const char *dir, *end;
+  struct stat st;
+  int len;
 
+  for(dir = path; ; dir = end + 1) {
+    end = strchr(dir, ':');
+    if(end == NULL) end = dir + strlen(dir);
 
+    // An empty entry is the current directory
+    if(end == dir) len = snprintf(candidate, sizeof(candidate), "%s", name);
+    else len = snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)(end - dir), dir, name);
 
-// Currently none of the following functions are being used as there seems to be some problem 
-// with using pipes in the intended manner using executeIntermediate(). See commented portion 
-// in execute.
+    if(len < (int)sizeof(candidate) && stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+      return (char*)allocOrDie(strdup(candidate));
 
-/*
+    if(*end == '\0') return NULL;
+  }
+}
 
-  Function to execute the left-most command in a series of piped commands
-  
-  Here reading is still from stdin. 
-  Output is written to the write-end of the pipe.
+static void clearResolved(void) {
+  int i;
 
-*/
+  for(i=0; i<capresolved; i++) {
+    free(resolvedtable[i].name);
+    free(resolvedtable[i].path);
+  }
+  free(resolvedtable);
+  resolvedtable = NULL;
+  capresolved = nresolved = 0;
+}
 
-void executeLeft(int pipefd[], char **args) {
-  int pid, wpid;
-  int status;
-  
-  if((pid = fork()) < 0) 
-    perror("Fork error");
+/*
+  Returns the absolute path execvp() would execute for name, or NULL if it has to be left to
+  execvp() (the name contains a '/', or nothing in PATH matches it).
+*/
+static char *resolveCommand(const char *name) {
+  const char *path = getenv("PATH");
+  struct resolved *old;
+  int oldcap, i;
+  unsigned long h;
+
+  if(name == NULL || strchr(name, '/') != NULL) return NULL;
+
+  // Same default as execvp() when PATH is not set
+  if(path == NULL) path = "/bin:/usr/bin";
+
+  if(resolvedpath == NULL || strcmp(resolvedpath, path) != 0) {
+    if(resolvedpath != NULL) launchStats.invalidations++;
+    clearResolved();
+    free(resolvedpath);
+    resolvedpath = (char*)allocOrDie(strdup(path));
+  }
 
-  else if(pid == 0) {
-    //child
-    dup2(pipefd[1], 1); // replace stdout with write end of pipe
-    close(pipefd[1]);
+  launchStats.lookups++;
+
+  if(2 * (nresolved + 1) > capresolved) {
+    old = resolvedtable;
+    oldcap = capresolved;
+    capresolved = capresolved ? capresolved * 2 : 64;
+    resolvedtable = (struct resolved*)allocOrDie(calloc(capresolved, sizeof(struct resolved)));
+    for(i=0; i<oldcap; i++) {
+      if(old[i].name == NULL) continue;
+      h = hashName(old[i].name) & (capresolved - 1);
+      while(resolvedtable[h].name != NULL) h = (h + 1) & (capresolved - 1);
+      resolvedtable[h] = old[i];
+    }
+    free(old);
+  }
 
-    execvp(args[0], args);
-    printf("Couldn't execute this command\n");
+  h = hashName(name) & (capresolved - 1);
+  while(resolvedtable[h].name != NULL) {
+    if(strcmp(resolvedtable[h].name, name) == 0) {
+      launchStats.hits++;
+      return resolvedtable[h].path;
+    }
+    h = (h + 1) & (capresolved - 1);
   }
 
-  else {
-    close(pipefd[1]); // close the write end of the pipe
-    //parent
-        do {
-          wpid = waitpid(pid, &status, 0);
-        } while(!WIFEXITED(status) && !WIFSIGNALED(status));
+  resolvedtable[h].name = (char*)allocOrDie(strdup(name));
+  resolvedtable[h].path = searchPath(name, path);
+  nresolved++;
+
+  return resolvedtable[h].path;
+}
+
+const char *commandPath(const char *name) {
+  if(name != NULL && strchr(name, '/') != NULL) return name;
+  return resolveCommand(name);
+}
+
+// Entry of name in the table, if it is there (no lookup is counted, nothing is resolved)
+static struct resolved *findResolved(const char *name) {
+  unsigned long h;
+
+  if(capresolved == 0 || name == NULL) return NULL;
+  h = hashName(name) & (capresolved - 1);
+  while(resolvedtable[h].name != NULL) {
+    if(strcmp(resolvedtable[h].name, name) == 0) return &resolvedtable[h];
+    h = (h + 1) & (capresolved - 1);
   }
+  return NULL;
+}
 
+static void pipeGrew(const char *command, int size) {
+  struct resolved *r = findResolved(command);
+  if(r != NULL && size > r->pipesize) r->pipesize = size;
 }
+
 /*
-  Function to execute the intermediate commands in a series of piped commands
-  
-  Here reading is from read-end of the pipe
-  Output is written to the write-end of the pipe.
+    Creates the pipe for the output of stage of the job, with the capacity the command of that
+    stage needed last time, and records it as an edge of the job (not inside #INTERSTART/#INTERSTOP,
+    where the edges go through captureEdge()). Returns 0, or -1 if the pipe can't be created.
 */
-void executeIntermediate(int pipefd[], char** args) {
-  int pid, wpid;
-  int status;
+static int newEdge(struct job *job, int stage, const char *command, int pipefd[2]) {
+  struct resolved *r = findResolved(command);
+  struct edge *e;
+
+  if(pipe2(pipefd, O_CLOEXEC) < 0) return -1;
+
+  if(r != NULL && r->pipesize > 0) fcntl(pipefd[1], F_SETPIPE_SZ, r->pipesize);
+  if(job->flags & JOB_INTER) return 0;
+
+  e = &job->edges[job->nedges++];
+  e->stage = stage;
+  e->command = command;
+  e->fd = fcntl(pipefd[0], F_DUPFD_CLOEXEC, 0);
+  e->size = fcntl(pipefd[1], F_GETPIPE_SZ);
+  e->grown = 0;
+  e->wrote = -1;
+  e->stalled = 0;
+  return 0;
+}
+
+void printLaunchStats(void) {
+  printf("PATH cache: %lu lookups, %lu hits (%.1f%%), %lu invalidations\n",
+         launchStats.lookups, launchStats.hits,
+         launchStats.lookups ? 100.0 * launchStats.hits / launchStats.lookups : 0.0,
+         launchStats.invalidations);
+}
+
+/*
+  Starts a child that runs argv with fdin, fdout and fderr as its
+  stdin, stdout and stderr. The descriptors in the parent are left untouched.
+  Returns the pid of the child, or -1 if it couldn't be started.
+
+  The command is looked up in the resolved-executable cache above first.
+
+  The child is created according to spawnBackend:
+
+  SPAWN_FORK  :   fork(), dup2() the descriptors in the child, then execve() (or execvp()).
+  SPAWN_POSIX :   posix_spawn() (or posix_spawnp()) with one dup2 file action per descriptor.
+                  glibc creates the child with clone(CLONE_VM | CLONE_VFORK), so the page tables
+                  of the executor are not copied, and reports a failed exec to the parent.
+*/
+int spawnBackend = SPAWN_FORK;
+
+int jobInput = STDIN_FILENO;
+
+pid_t launchCommand(char **argv, int fdin, int fdout, int fderr, pid_t *pgid) {
+  pid_t pid;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t none;
+  char *path = resolveCommand(argv[0]);
+  int err;
 
-  if((pid = fork()) < 0) 
+  // The scheduler blocks SIGCHLD (it reads it from a signalfd): commands start with no signal blocked
+  sigemptyset(&none);
+
+  if(spawnBackend == SPAWN_POSIX) {
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    if(pgid != NULL) posix_spawnattr_setpgroup(&attr, *pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | (pgid != NULL ? POSIX_SPAWN_SETPGROUP : 0));
+
+    posix_spawn_file_actions_init(&actions);
+    if(fdin != STDIN_FILENO) posix_spawn_file_actions_adddup2(&actions, fdin, STDIN_FILENO);
+    if(fdout != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&actions, fdout, STDOUT_FILENO);
+    if(fderr != STDERR_FILENO) posix_spawn_file_actions_adddup2(&actions, fderr, STDERR_FILENO);
+
+    if(argv[0] == NULL) err = ENOENT;
+    else if(path != NULL) {
+      err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+      if(err != 0) err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    }
+    else err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if(err != 0) {
+      // Same message the child prints when execvp() fails, in the same place
+      write(fdout, "Couldn't execute this command\n", 30);
+      return -1;
+    }
+
+    if(pgid != NULL && *pgid == 0) *pgid = pid;
+    return pid;
+  }
+
+  if((pid = fork()) < 0) {
     perror("Fork error");
+    return -1;
+  }
 
-  else if(pid == 0) {
+  if(pid == 0) {
     // child
-    dup2(pipefd[0], 0); // replace stdin with read end of pipe
-    close(pipefd[0]);
-    // close(pipefd[1]);
+    if(pgid != NULL) setpgid(0, *pgid);
+    if(fdin != STDIN_FILENO) dup2(fdin, STDIN_FILENO);
+    if(fdout != STDOUT_FILENO) dup2(fdout, STDOUT_FILENO);
+    if(fderr != STDERR_FILENO) dup2(fderr, STDERR_FILENO);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    if(path != NULL) execve(path, argv, environ);
+    execvp(argv[0], argv);
+
+    // Not printf(): the stdio buffer inherited from the parent may still hold its unflushed output
+    write(STDOUT_FILENO, "Couldn't execute this command\n", 30);
+    _exit(127);
+  }
 
-    dup2(pipefd[1], 1); // replace stdout with write end of pipe
-    close(pipefd[1]);
-    // close(pipefd[0]);
+  // Also done here, so that the group exists as soon as fork() returns in both processes
+  if(pgid != NULL) {
+    setpgid(pid, *pgid);
+    if(*pgid == 0) *pgid = pid;
+  }
 
-    execvp(args[0], args);
-    printf("Couldn't execute this command\n");
+  return pid;
+}
+
+
+
+
+// Closes every descriptor above stderr except the n ones in keep (which is sorted)
+static void keepOnly(int *keep, int n) {
+  int lo = STDERR_FILENO + 1;
+  int i, j, t;
+
+  for(i=0; i<n; i++)
+    for(j=i+1; j<n; j++)
+      if(keep[j] < keep[i]) { t = keep[i]; keep[i] = keep[j]; keep[j] = t; }
+
+  for(i=0; i<n; i++) {
+    if(keep[i] < lo) continue;
+    if(keep[i] > lo) close_range(lo, keep[i] - 1, 0);
+    lo = keep[i] + 1;
   }
+  close_range(lo, ~0U, 0);
+}
 
-  else {
-    // check this
-    // close(pipefd[0]);
+/*
+  Copies the data on one edge of a pipeline into INTER.<line>.<edge>.txt without it
+  ever passing through userspace.
+
+  in is the read end of the pipe the stage before the edge writes to. A helper process
+  (a fork of the executor, no exec) moves the data from in to a new pipe with tee(),
+  which duplicates the pipe buffers instead of copying the bytes, and then consumes the
+  same bytes from in by splice()-ing them to the file.
+
+  Returns the read end of the new pipe, which the stage after the edge must read from
+  (or in itself if the capture couldn't be set up).
+*/
+int captureEdge(struct job *job, int edge, int in) {
+  char name[64];
+  int keep[3];
+  int filefd;
+  int pipefd[2];
+  pid_t pid;
+  ssize_t n, m;
+
+  snprintf(name, sizeof(name), "INTER.%d.%d.txt", job->lineno, edge);
+
+  // Not O_APPEND: splice() refuses to write to files opened for appending
+  filefd = open(name, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+  if(filefd < 0) {
+    perror(name);
+    return in;
+  }
+
+  if(pipe2(pipefd, O_CLOEXEC) < 0) {
+    perror("Pipe error");
+    close(filefd);
+    return in;
+  }
+
+  if((pid = fork()) < 0) {
+    perror("Fork error");
+    close(pipefd[0]);
     close(pipefd[1]);
-    do {
-          wpid = waitpid(pid, &status, 0);
-    } while(!WIFEXITED(status) && !WIFSIGNALED(status));
+    close(filefd);
+    return in;
+  }
+
+  if(pid == 0) {
+    // helper. The read end of the new pipe belongs to the next stage only:
+    // if it exits early, tee() must fail with EPIPE instead of blocking.
+    // Nor does it keep any other descriptor of the executor (pipes, pidfds) alive.
+    keep[0] = in;
+    keep[1] = pipefd[1];
+    keep[2] = filefd;
+    keepOnly(keep, 3);
+    if(job->flags & JOB_GROUP) setpgid(0, job->pgid);
+
+    for(;;) {
+      n = tee(in, pipefd[1], INT_MAX, 0);
+      if(n == 0) break;         // the stage before the edge is done and the pipe is empty
+      if(n < 0) {
+        if(errno == EINTR) continue;
+        break;
+      }
 
-    printf("We're in parent intermediate\n");
-    int i;
-    char buf[256];
-    if((i = read(pipefd[0], buf, sizeof(buf))) > 0) {
-            printf("%s ", buf);
-            printf("So, this probably works and I'm not seeing that!\n");
+      // tee() left the bytes in the pipe: consume exactly as many into the file
+      while(n > 0) {
+        m = splice(in, NULL, filefd, NULL, n, SPLICE_F_MOVE);
+        if(m <= 0) {
+          if(m < 0 && errno == EINTR) continue;
+          perror(name);
+          _exit(1);
+        }
+        n -= m;
+      }
     }
-    buf[i] = 0;
 
+    _exit(0);
+  }
+
+  // parent
+  if(job->flags & JOB_GROUP) {
+    setpgid(pid, job->pgid);
+    if(job->pgid == 0) job->pgid = pid;
   }
+  close(in);
+  close(pipefd[1]);
+  close(filefd);
+
+  addProcess(job, pid, -1, "tee");
+
+  return pipefd[0];
+}
 
+/*
+  Fan-out (see struct command).
+
+  The producer's last stage writes to one pipe, read by a helper process (a fork of the executor,
+  like the one of captureEdge()) that hands the data to a pipe per consumer. For every consumer
+  but the last, tee() duplicates the pipe buffers without copying the bytes; the last one gets
+  them moved with splice(), which consumes them. Only when a consumer is behind (tee() could
+  duplicate part of the bytes only) does the helper read the bytes and write the rest itself.
+  A consumer that exits early is dropped; once all of them are gone, the helper exits and the
+  producer gets SIGPIPE. A share file (a consumer without stages) is dropped the same way once it
+  holds more than SHARE_MAX bytes.
+
+  The first consumer writing to the job's output does so directly. The next ones write to memory
+  files (job->spills), appended to the job's output once the line is done, so that the outputs
+  come out in the order the consumers are written in.
+*/
+
+// Writes all of buf to fd. Returns -1 if it can't (the reader is gone).
+static int writeAll(int fd, const char *buf, size_t len) {
+  ssize_t n;
+
+  while(len > 0) {
+    n = write(fd, buf, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
 }
 
+/*
+  Counts m more bytes given to the last descriptor of outs, a share file if limited: it is dropped
+  once it holds more than SHARE_MAX bytes.
+*/
+static void shareWritten(int *outs, int n, int limited, ssize_t m, size_t *shared) {
+  if(!limited || outs[n - 1] < 0) return;
+  *shared += m;
+  if(*shared > SHARE_MAX) {
+    close(outs[n - 1]);
+    outs[n - 1] = -1;
+  }
+}
 
 /*
-  Function to execute the right-most command in a series of piped commands
-  
-  Here reading is from read-end of the pipe
-  Output is written to stdout(for now - testing) (i.e., change that to OUTPUT.txt later)
+  Copies everything from in to every descriptor of outs (-1 once its consumer is gone).
+  If limited, the last one is a share file (see shareWritten()).
 */
-void executeRight(int pipefd[], char** args) {
-  int pid, wpid;
-  int len;
-  int i,j;
-  int op1 = 0;
-  int op2 = 0;
-  int opPipe = 0;
-  int status;
+static void fanOut(int in, int *outs, int n, int limited) {
+  ssize_t *sent = (ssize_t*)allocOrDie(calloc(n, sizeof(ssize_t)));
+  char *buf = NULL;
+  size_t cap = 0, shared = 0;
+  ssize_t len, m, got;
+  int k, last, partial;
+
+  for(;;) {
+    for(last = n - 1; last >= 0 && outs[last] < 0; last--)
+      ;
+    if(last < 0) return;
+
+    // Duplicated for every consumer before the last one, still in in afterwards
+    len = -1;
+    partial = 0;
+    for(k=0; k<last; k++) {
+      if(outs[k] < 0) continue;
+      m = tee(in, outs[k], len < 0 ? INT_MAX : (size_t)len, 0);
+      if(m < 0 && errno == EINTR) { k--; continue; }
+      if(m < 0) {
+        close(outs[k]);
+        outs[k] = -1;
+        continue;
+      }
+      if(len < 0) {
+        if(m == 0) return;    // the producer is done, and everything is handed over
+        len = m;
+      }
+      sent[k] = m;
+      if(m < len) partial = 1;
+    }
 
-  int out_fd;
+    // Moved to the last one
+    if(len < 0) {
+      m = splice(in, NULL, outs[last], NULL, INT_MAX, 0);
+      if(m == 0) return;
+      if(m < 0 && errno != EINTR) {
+        close(outs[last]);
+        outs[last] = -1;
+      }
+      if(m > 0 && last == n - 1) shareWritten(outs, n, limited, m, &shared);
+      continue;
+    }
 
-  len = argsLength(args);
+    if(!partial) {
+      while(len > 0 && outs[last] >= 0) {
+        m = splice(in, NULL, outs[last], NULL, len, 0);
+        if(m < 0 && errno == EINTR) continue;
+        if(m <= 0) {
+          close(outs[last]);
+          outs[last] = -1;
+          break;
+        }
+        len -= m;
+        if(last == n - 1) shareWritten(outs, n, limited, m, &shared);
+      }
+      if(len == 0) continue;
+      // The others have these bytes already: they only need to be consumed
+      for(k=0; k<last; k++) sent[k] = len;
+    }
 
-  for(i = 0; i<len; i++) {
-    if(strcmp(args[i], ">") == 0) { op1=i; }       // pos of ">"
-    else if(strcmp(args[i], ">>") == 0) { op2=i; }   // pos of ">>"
-      // Check for this later
-     // else if(strcmp(args[i], "|") == 0) { opPipe=i; }       // pos of "|"
+    // Read out of in, and written to whoever didn't get all of them
+    if(cap < (size_t)len) {
+      cap = len;
+      buf = (char*)allocOrDie(realloc(buf, cap));
+    }
+    for(got = 0; got < len; got += m) {
+      m = read(in, buf + got, len - got);
+      if(m < 0 && errno == EINTR) m = 0;
+      else if(m <= 0) return;
+    }
+    for(k=0; k<=last; k++) {
+      if(outs[k] < 0) continue;
+      if(k == last) sent[k] = 0;
+      if(sent[k] < len && writeAll(outs[k], buf + sent[k], len - sent[k]) < 0) {
+        close(outs[k]);
+        outs[k] = -1;
+      }
+      else if(k == n - 1 && sent[k] < len) shareWritten(outs, n, limited, len - sent[k], &shared);
+    }
   }
+}
 
-  // Case: No '>' or '>>'
-  if(op1 == 0 && op2 == 0) {
-    
-    // printf("Getting ready to execute right side of pipe command\n");
+/*
+  Starts the n commands of a pipeline, numbered from stage in the job, reading fin and writing
+  fout (both closed here, once the stages have them).
+*/
+static void startStages(char **commands[], int n, int stage, int fin, int fout, struct job *job) {
+  int nextin = -1;
+  int pipefd[2];
+  int out;
+  pid_t pid;
+  int i;
 
-    if((pid = fork()) < 0) 
-      perror("Fork error");
+  for(i=0; i<n; i++) {
+    if(i == n-1) out = fout;
+    else {
+      if(newEdge(job, stage + i, commands[i][0], pipefd) < 0) {
+        perror("Pipe error");
+        break;
+      }
+      out = pipefd[1];
+      nextin = pipefd[0];
+    }
 
-    else if(pid == 0) {
-      //child
-      dup2(pipefd[0], 0); // replace stdin with pipe's read end
-      
-      // DEBUG
-      int fd = open("OUTPUT.txt", O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IRGRP | S_IWGRP |S_IWUSR); // user - r and w permissions. 
+    pid = launchCommand(commands[i], fin, out, STDERR_FILENO, jobGroup(job));
+    if(pid > 0)
+      addProcess(job, pid, stage + i, commands[i][0]);
+    else if(job->nedges > 0 && job->edges[job->nedges - 1].stage == stage + i - 1)
+      closeEdge(&job->edges[job->nedges - 1]);
+
+    if(fin != jobInput) close(fin);
+    close(out);
+
+    fin = nextin;
+    if(i < n-1 && (job->flags & JOB_INTER))
+      fin = captureEdge(job, stage + i + 1, fin);
+  }
+
+  // Setting up a stage failed half-way: nobody reads the last pipe, and fout is unused
+  if(i < n) {
+    if(fin != jobInput) close(fin);
+    if(i > 0 && job->nedges > 0) closeEdge(&job->edges[job->nedges - 1]);
+    close(fout);
+  }
+}
+
+// Forks the helper copying in to outs (see fanOut(), for limited). Returns its pid, or -1.
+static pid_t startFanoutHelper(struct job *job, int in, int *outs, int n, int limited) {
+  int *keep;
+  pid_t pid;
+  int k;
+
+  if((pid = fork()) < 0) {
+    perror("Fork error");
+    return -1;
+  }
 
-      dup2(fd, 1);    // to make stdout go to file. (1 is the file descriptor for stdout)
-      dup2(fd, 2);    // to make stderr go to file. (2 is the file descriptor for stderr)
+  if(pid == 0) {
+    // A consumer that is gone is an error of tee(), splice() or write(), not a signal
+    signal(SIGPIPE, SIG_IGN);
+    keep = (int*)allocOrDie(malloc((n + 1) * sizeof(int)));
+    keep[0] = in;
+    for(k=0; k<n; k++) keep[k + 1] = outs[k];
+    keepOnly(keep, n + 1);
+    if(job->flags & JOB_GROUP) setpgid(0, job->pgid);
+
+    fanOut(in, outs, n, limited);
+    _exit(0);
+  }
+
+  if(job->flags & JOB_GROUP) {
+    setpgid(pid, job->pgid);
+    if(job->pgid == 0) job->pgid = pid;
+  }
+  addProcess(job, pid, -1, "tee");
+  return pid;
+}
 
-      close(fd); 
-      close(pipefd[0]);
+static void startFanout(struct command *cmd, struct job *job) {
+  struct command *b;
+  int total = cmd->nstages;
+  int producer[2], consumer[2];
+  int *ins, *outs;
+  int direct = 0;     // some consumer writes to the job's output already
+  int stage, fout, k;
+
+  for(k=0; k<cmd->nbranches; k++) total += cmd->branches[k].nstages;
+
+  job->procs = (struct process*)arenaAlloc(job->arena, (2 * total + 1) * sizeof(struct process));
+  job->edges = (struct edge*)arenaAlloc(job->arena, total * sizeof(struct edge));
+  job->spills = (int*)arenaAlloc(job->arena, cmd->nbranches * sizeof(int));
+  ins = (int*)arenaAlloc(job->arena, cmd->nbranches * sizeof(int));
+  outs = (int*)arenaAlloc(job->arena, cmd->nbranches * sizeof(int));
+
+  if(pipe2(producer, O_CLOEXEC) < 0) {
+    perror("Pipe error");
+    return;
+  }
 
+  for(k=0; k<cmd->nbranches; k++) {
+    // No stages: the helper writes to the job's share file itself (splice() can, tee() can't: it is the last consumer)
+    if(cmd->branches[k].nstages == 0) {
+      ins[k] = -1;
+      if((outs[k] = fcntl(job->sharefd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        perror("Shared output");
+        break;
+      }
+      continue;
+    }
 
-      printf("\n\n");
-      execvp(args[0], args);
-      printf("Couldn't execute this command\n");
+    if(pipe2(consumer, O_CLOEXEC) < 0) {
+      perror("Pipe error");
+      break;
     }
+    ins[k] = consumer[0];
+    outs[k] = consumer[1];
+  }
 
+  if(k < cmd->nbranches || startFanoutHelper(job, producer[0], outs, cmd->nbranches, cmd->branches[k - 1].nstages == 0) < 0) {
+    while(k-- > 0) {
+      if(ins[k] >= 0) close(ins[k]);
+      close(outs[k]);
+    }
+    close(producer[0]);
+    close(producer[1]);
+    return;
+  }
+
+  // The helper holds the pipes it copies between now
+  close(producer[0]);
+  for(k=0; k<cmd->nbranches; k++) close(outs[k]);
+
+  startStages(cmd->stages, cmd->nstages, 0, jobInput, producer[1], job);
+
+  stage = cmd->nstages;
+  for(k=0; k<cmd->nbranches; k++) {
+    b = &cmd->branches[k];
+    if(b->nstages == 0) continue;
+
+    if(b->redirect == REDIRECT_TRUNC)
+      fout = open(b->redirectfile, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+    else if(b->redirect == REDIRECT_APPEND)
+      fout = open(b->redirectfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+    else if(!direct++)
+      fout = fcntl(job->outfd, F_DUPFD_CLOEXEC, 0);
+    else if((fout = memfd_create("fanout", MFD_CLOEXEC)) >= 0)
+      job->spills[job->nspills++] = fcntl(fout, F_DUPFD_CLOEXEC, 0);
+
+    if(fout < 0) {
+      perror(b->redirect != REDIRECT_NONE ? b->redirectfile : "Fan-out output");
+      close(ins[k]);
+    }
     else {
-      //parent
-      do {
-        wpid = waitpid(pid, &status, 0);
-      } while(!WIFEXITED(status) && !WIFSIGNALED(status));
+      if(b->redirect != REDIRECT_NONE) setOutfile(job, b->redirectfile, fout);
+      startStages(b->stages, b->nstages, stage, ins[k], fout, job);
     }
+    stage += b->nstages;
+  }
+}
+
+/*
+  Where the last stage of cmd writes: its '>'/'>>' target, or a copy of the job's output.
+  Returns -1 (reported) if it can't be opened.
+*/
+static int openTarget(struct command *cmd, struct job *job) {
+  int out;
+
+  if(cmd->redirect == REDIRECT_TRUNC)
+    out = open(cmd->redirectfile, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+  else if(cmd->redirect == REDIRECT_APPEND)
+    out = open(cmd->redirectfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+  else
+    out = fcntl(job->outfd, F_DUPFD_CLOEXEC, 0);
+
+  if(out < 0) perror(cmd->redirect != REDIRECT_NONE ? cmd->redirectfile : "OUTPUT.txt");
+  else if(cmd->redirect != REDIRECT_NONE) setOutfile(job, cmd->redirectfile, out);
+  return out;
+}
+
+// The stages of cmd, the first one reading job->infd (see startCommand())
+static void startShared(struct command *cmd, struct job *job) {
+  int out;
+
+  job->procs = (struct process*)arenaAlloc(job->arena, 2 * cmd->nstages * sizeof(struct process));
+  job->edges = (struct edge*)arenaAlloc(job->arena, cmd->nstages * sizeof(struct edge));
+
+  if((out = openTarget(cmd, job)) < 0) close(job->infd);
+  else startStages(cmd->stages, cmd->nstages, 0, job->infd, out, job);
+  job->infd = -1;
+}
+
+/*
+  Sharded lines (see mergeMode() in execute.h).
+*/
+
+int mergeMode(char **merge) {
+  if(merge == NULL || merge[0] == NULL || strcmp(merge[0], "concat") == 0) return MERGE_CONCAT;
+  if(strcmp(merge[0], "sum") == 0) return MERGE_SUM;
+  if(strcmp(merge[0], "sort") == 0) return MERGE_SORT;
+  return -1;
+}
+
+/*
+  Index of the argument of argv to shard: its last one, if it names a regular file and is not an
+  option. -1 if it doesn't, or if an earlier argument names a regular file too: the pattern of
+  "grep foo big.txt" could be a file of the directory, and which file the command reads as its
+  input can't be told apart from the others (the line then runs as it is).
+*/
+static int shardedArgument(char **argv) {
+  struct stat st;
+  int k, last;
 
+  for(last=1; argv[last] != NULL && argv[last + 1] != NULL; last++)
+    ;
+  if(argv[last] == NULL || argv[last][0] == '-' || stat(argv[last], &st) < 0 || !S_ISREG(st.st_mode)) return -1;
+
+  for(k=1; k<last; k++)
+    if(argv[k][0] != '-' && stat(argv[k], &st) == 0 && S_ISREG(st.st_mode)) return -1;
+  return last;
+}
+
+/*
+  Splits the file fd (of size bytes) into at most n ranges ending at newlines: range i is
+  [cuts[i], cuts[i+1]). Returns the number of ranges.
+*/
+static int cutFile(int fd, off_t size, int n, off_t *cuts) {
+  char *map, *nl;
+  off_t at;
+  int m = 0, i;
+
+  if(n > size / SHARD_MIN) n = size / SHARD_MIN;
+  cuts[0] = 0;
+  if(n <= 1 || (map = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    cuts[1] = size;
+    return 1;
   }
 
-  // case: one of '>' or '>>' is present and 
-  // output must be redirected to the corresponding file
-  else if(op1 != 0 || op2 != 0) {
+  for(i=1; i<n; i++) {
+    // A range ends with the first newline at or after its share of the file
+    at = size / n * i;
+    if(at <= cuts[m]) continue;
+    nl = (char*)memchr(map + at - 1, '\n', size - at + 1);
+    at = nl ? nl - map + 1 : size;
+    if(at > cuts[m] && at < size) cuts[++m] = at;
+  }
+  cuts[++m] = size;
 
-    if((pid = fork()) < 0) 
-      perror("Fork error");
+  munmap(map, size);
+  return m;
+}
 
-    else if(pid == 0) {
-      //child
-      if(op1 != 0) {
-        args[op1] = NULL;
-        out_fd = open(args[op1+1], O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+// Forks a helper writing bytes [from, to) of the file fd to a new pipe. Returns its read end, or -1.
+static int feedShard(struct job *job, int fd, off_t from, off_t to) {
+  char buf[65536];
+  int pipefd[2], keep[2];
+  loff_t off = from;
+  ssize_t n;
+  pid_t pid;
+
+  if(pipe2(pipefd, O_CLOEXEC) < 0) {
+    perror("Pipe error");
+    return -1;
+  }
+
+  if((pid = fork()) < 0) {
+    perror("Fork error");
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return -1;
+  }
+
+  if(pid == 0) {
+    // A pipeline that stops reading early ends the copy, as it would reading the file
+    signal(SIGPIPE, SIG_IGN);
+    keep[0] = fd;
+    keep[1] = pipefd[1];
+    keepOnly(keep, 2);
+    if(job->flags & JOB_GROUP) setpgid(0, job->pgid);
+
+    while(off < to) {
+      n = splice(fd, &off, pipefd[1], NULL, to - off, 0);
+      if(n < 0 && errno == EINTR) continue;
+      if(n < 0 && errno == EINVAL) {
+        // The file system can't splice: copied through a buffer
+        n = pread(fd, buf, to - off < (off_t)sizeof(buf) ? (size_t)(to - off) : sizeof(buf), off);
+        if(n <= 0 || writeAll(pipefd[1], buf, n) < 0) break;
+        off += n;
+        continue;
+      }
+      if(n <= 0) break;
+    }
+    _exit(0);
+  }
+
+  if(job->flags & JOB_GROUP) {
+    setpgid(pid, job->pgid);
+    if(job->pgid == 0) job->pgid = pid;
+  }
+  close(pipefd[1]);
+
+  addProcess(job, pid, -1, "shard");
+  return pipefd[0];
+}
+
+// Whether the token [s, e) is an integer
+static int isNumber(const char *s, const char *e) {
+  if(s < e && (*s == '-' || *s == '+')) s++;
+  if(s == e) return 0;
+  for(; s < e; s++)
+    if(*s < '0' || *s > '9') return 0;
+  return 1;
+}
+
+/*
+  Adds up the numbers of the n outputs, token by token (the k-th token of every output is
+  added to the k-th of the others), and writes them to out in the layout of the first
+  output that isn't empty, each number at least as wide as the one it replaces.
+*/
+static void writeSum(char **texts, size_t *lens, int n, int out) {
+  long long *sums = NULL;
+  int nsums = 0, capsums = 0;
+  char *p, *e, *s, num[32];
+  int i, k, len, first = -1;
+
+  for(i=0; i<n; i++) {
+    if(lens[i] == 0) continue;
+    if(first < 0) first = i;
+
+    p = texts[i];
+    e = texts[i] + lens[i];
+    for(k=0;; k++) {
+      while(p < e && (*p == ' ' || *p == '\t' || *p == '\n')) p++;
+      if(p == e) break;
+      for(s = p; p < e && *p != ' ' && *p != '\t' && *p != '\n'; p++)
+        ;
+      if(k == capsums) {
+        capsums = capsums ? capsums * 2 : 16;
+        sums = (long long*)allocOrDie(realloc(sums, capsums * sizeof(long long)));
+      }
+      if(k == nsums) sums[nsums++] = 0;
+      if(isNumber(s, p)) sums[k] += strtoll(s, NULL, 10);
+    }
+  }
+  if(first < 0) return;
+
+  p = texts[first];
+  e = texts[first] + lens[first];
+  for(k=0; p < e; k++) {
+    for(s = p; p < e && (*p == ' ' || *p == '\t' || *p == '\n'); p++)
+      ;
+    writeAll(out, s, p - s);
+    if(p == e) break;
+
+    for(s = p; p < e && *p != ' ' && *p != '\t' && *p != '\n'; p++)
+      ;
+    if(isNumber(s, p)) {
+      len = snprintf(num, sizeof(num), "%*lld", (int)(p - s), sums[k]);
+      writeAll(out, num, len);
+    }
+    else writeAll(out, s, p - s);
+  }
+  free(sums);
+}
+
+/*
+  Merges the outputs of the n shards (ins, in file order) into out. With MERGE_CONCAT, the
+  output of the first shard not done yet is written as it comes, the later ones are kept in
+  memory files until their turn. With MERGE_SUM, all of them are read first.
+*/
+static void mergeOutputs(int *ins, int n, int out, int mode) {
+  struct pollfd *fds = (struct pollfd*)allocOrDie(calloc(n, sizeof(struct pollfd)));
+  int *spills = (int*)allocOrDie(malloc(n * sizeof(int)));
+  char **texts = (char**)allocOrDie(calloc(n, sizeof(char*)));
+  size_t *lens = (size_t*)allocOrDie(calloc(n, sizeof(size_t)));
+  size_t *caps = (size_t*)allocOrDie(calloc(n, sizeof(size_t)));
+  char buf[65536];
+  int live = n, cur = 0, i;
+  ssize_t r;
+
+  for(i=0; i<n; i++) {
+    fds[i].fd = ins[i];
+    fds[i].events = POLLIN;
+    spills[i] = -1;
+  }
+
+  while(live > 0) {
+    if(poll(fds, n, -1) < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+
+    for(i=0; i<n; i++) {
+      if(fds[i].fd < 0 || !fds[i].revents) continue;
+
+      r = read(fds[i].fd, buf, sizeof(buf));
+      if(r < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+      if(r <= 0) {
+        // Done: poll() ignores negative descriptors
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        live--;
+        continue;
       }
 
+      if(mode == MERGE_SUM) {
+        if(lens[i] + r > caps[i]) {
+          caps[i] = 2 * (lens[i] + r);
+          texts[i] = (char*)allocOrDie(realloc(texts[i], caps[i]));
+        }
+        memcpy(texts[i] + lens[i], buf, r);
+        lens[i] += r;
+      }
+      else if(i == cur) writeAll(out, buf, r);
       else {
-        args[op2] = NULL;
-        out_fd = open(args[op2+1], O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+        if(spills[i] < 0 && (spills[i] = memfd_create("shard", MFD_CLOEXEC)) < 0) _exit(1);
+        writeAll(spills[i], buf, r);
       }
+    }
 
-      
-      dup2(out_fd, 1);  // replace stdout with out_fd
-      close(out_fd);    
+    // The shards that are done are written in order, up to the first one still running
+    while(mode == MERGE_CONCAT && cur < n && fds[cur].fd < 0) {
+      if(++cur < n && spills[cur] >= 0) {
+        lseek(spills[cur], 0, SEEK_SET);
+        copyData(spills[cur], out, NULL);
+        close(spills[cur]);
+        spills[cur] = -1;
+      }
+    }
+  }
 
-      dup2(pipefd[0], 0); //replace stdin with read end of pipe
-      close(pipefd[0]);
+  if(mode == MERGE_SUM) writeSum(texts, lens, n, out);
+}
 
-      execvp(args[0], args);
-      printf("Couldn't execute this command\n");
+/*
+  Starts what merges the outputs of the n shards (ins) into out, and closes the executor's copies
+  of both: "sort -m" reading them as /dev/fd/<in>, or a helper process (mergeOutputs()).
+*/
+static void startMerge(struct job *job, int *ins, int n, int out, int mode, char **merge, int stage) {
+  char **argv, name[32];
+  int *keep;
+  pid_t pid;
+  int i, k;
+
+  if(mode == MERGE_SORT) {
+    argv = (char**)arenaAlloc(job->arena, (argsLength(merge) + n + 2) * sizeof(char*));
+    k = 0;
+    argv[k++] = "sort";
+    argv[k++] = "-m";
+    for(i=1; merge[i] != NULL; i++) argv[k++] = merge[i];
+    for(i=0; i<n; i++) {
+      // Inherited by sort under the same numbers
+      snprintf(name, sizeof(name), "/dev/fd/%d", ins[i]);
+      argv[k++] = arenaStrndup(job->arena, name, strlen(name));
+      fcntl(ins[i], F_SETFD, 0);
     }
+    argv[k] = NULL;
 
-    else {
-      // parent
-      do {
-        wpid = waitpid(pid, &status, 0);
-      } while(!WIFEXITED(status) && !WIFSIGNALED(status));
+    pid = launchCommand(argv, jobInput, out, STDERR_FILENO, jobGroup(job));
+    if(pid > 0) addProcess(job, pid, stage, "sort");
+  }
+
+  else if((pid = fork()) < 0) perror("Fork error");
+
+  else if(pid == 0) {
+    // The line may be cut short by whoever reads its output
+    signal(SIGPIPE, SIG_IGN);
+    keep = (int*)allocOrDie(malloc((n + 1) * sizeof(int)));
+    for(i=0; i<n; i++) keep[i] = ins[i];
+    keep[n] = out;
+    keepOnly(keep, n + 1);
+    if(job->flags & JOB_GROUP) setpgid(0, job->pgid);
+
+    mergeOutputs(ins, n, out, mode);
+    _exit(0);
+  }
+
+  else {
+    if(job->flags & JOB_GROUP) {
+      setpgid(pid, job->pgid);
+      if(job->pgid == 0) job->pgid = pid;
     }
+    addProcess(job, pid, stage, "merge");
+  }
 
+  for(i=0; i<n; i++) close(ins[i]);
+  close(out);
+}
 
+int startParallel(struct command *cmd, struct job *job, int shards, char **merge) {
+  char **argv = cmd->stages[0];
+  char ***stages;
+  struct stat st;
+  off_t *cuts;
+  int *ins;
+  int pipefd[2];
+  int mode = mergeMode(merge);
+  int file, fd, out, in, n, m, i, k;
+
+  if(cmd->nbranches > 0 || mode < 0 || shards < 2 || (file = shardedArgument(argv)) < 0)
+    return startCommand(cmd, job);
+  if((fd = open(argv[file], O_RDONLY | O_CLOEXEC)) < 0) return startCommand(cmd, job);
+  if(fstat(fd, &st) < 0) {
+    close(fd);
+    return startCommand(cmd, job);
   }
 
+  cuts = (off_t*)arenaAlloc(job->arena, (shards + 1) * sizeof(off_t));
+  m = cutFile(fd, st.st_size, shards, cuts);
+
+  // Too small to split: the line runs as it is written, file name and all
+  if(m < 2) {
+    close(fd);
+    return startCommand(cmd, job);
+  }
 
-}   // end of executeRight
+  clearJob(job);
+  n = cmd->nstages;
+  job->shards = m;
+  job->shardstages = n;
+
+  // The same pipeline, with the first command reading its range on stdin instead of the file
+  stages = (char***)arenaAlloc(job->arena, n * sizeof(char**));
+  memcpy(stages, cmd->stages, n * sizeof(char**));
+  stages[0] = (char**)arenaAlloc(job->arena, argsLength(argv) * sizeof(char*));
+  for(i=k=0; argv[i] != NULL; i++)
+    if(i != file) stages[0][k++] = argv[i];
+  stages[0][k] = NULL;
+
+  // Per shard: its feeder, its stages and their INTER helpers. Then the merge.
+  job->procs = (struct process*)arenaAlloc(job->arena, (m * (2 * n + 1) + 1) * sizeof(struct process));
+  job->edges = (struct edge*)arenaAlloc(job->arena, m * n * sizeof(struct edge));
+  ins = (int*)arenaAlloc(job->arena, m * sizeof(int));
+
+  if((out = openTarget(cmd, job)) < 0) {
+    close(fd);
+    return 0;
+  }
+
+  // As the line would without shards (see startCommand())
+  if(n == 1) write(out, "\n\n", 2);
+
+  for(i=0; i<m; i++) {
+    if(pipe2(pipefd, O_CLOEXEC) < 0) {
+      perror("Pipe error");
+      break;
+    }
+    ins[i] = pipefd[0];
+
+    // A shard that can't be fed is empty: the merge sees the end of its output at once
+    if((in = feedShard(job, fd, cuts[i], cuts[i+1])) < 0) close(pipefd[1]);
+    else startStages(stages, n, i * n, in, pipefd[1], job);
+  }
+  close(fd);
+
+  startMerge(job, ins, i, out, mode, merge, m * n);
+  return job->nrunning;
+}
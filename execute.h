@@ -1,3 +1,9 @@
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <time.h>
+
+struct arena;
+
 // To find the length of the array of arguments
 int argsLength(char **args);
 
@@ -13,6 +19,8 @@ int argsLength(char **args);
 
     IMPORTANT NOTE: For correct parsing, all input in the batch file is assumed to have correct (non-built in functions only) input, separated by spaces.
 
+    lineno is the line number of the line in the batch file, flags a combination of the JOB_ flags below.
+
     HOW IT WORKS:
 
     1. Get the length of the arguments array (i.e., no of arguments)
@@ -37,7 +45,232 @@ int argsLength(char **args);
         Parse the arguments further and put them into an array of commands.
         Call executePipeCommands function that handles multiple pipes.
 */
-int execute(char** args);
+int execute(char** args, int lineno, int flags);
+
+// Flags of a line
+#define JOB_INTER 1     // inside #INTERSTART/#INTERSTOP: every pipe edge is also copied to a file (see captureEdge())
+#define JOB_GROUP 2     // all processes of the line run in a process group of their own (pgid), so they can be killed together
+
+/*
+    One process started for a line.
+
+    pid     :   its pid
+    stage   :   its place in the pipeline (from 0), or -1 for the helper of an edge capture
+    command :   name of the command it runs
+    start   :   when it was started, end: when it was reaped (CLOCK_MONOTONIC)
+    reaped  :   set once it has been reaped, with its wait status and resource usage (wait4())
+    pidfd   :   descriptor the scheduler watches the process through (-1 if none, see jobs.c)
+*/
+struct process {
+    pid_t pid;
+    int stage;
+    const char *command;
+    int pidfd;
+    struct timespec start, end;
+    int reaped;
+    int status;
+    struct rusage usage;
+};
+
+/*
+    One pipe between two stages of a pipeline (an edge), as the executor sees it.
+
+    stage   :   the stage writing to it (stage + 1 reads it)
+    command :   name of the command of that stage
+    fd      :   the executor's own copy of the read end, to see how full the pipe is. Closed (-1)
+                as soon as the reading stage is reaped: the executor must never be the last
+                reader, or a writer whose reader is gone would block instead of getting SIGPIPE.
+    size    :   capacity of the pipe (F_GETPIPE_SZ), doubled by sampleEdges() while it is full
+    grown   :   number of times it was doubled
+    wrote   :   bytes the process of the writing stage wrote in all ("wchar" of /proc/<pid>/io,
+                read just before it is reaped), -1 if unknown. Not the traffic on this pipe alone:
+                what the stage wrote to stderr or to other files counts too.
+    stalled :   ms the pipe was seen full, with the writer blocked on it (at EDGE_SAMPLE_MS resolution)
+*/
+struct edge {
+    int stage;
+    const char *command;
+    int fd;
+    int size;
+    int grown;
+    long long wrote;
+    double stalled;
+};
+
+/*
+    The processes started for one line of the batch file.
+
+    lineno  :   line number in the batch file
+    flags   :   JOB_ flags of the line
+    arena   :   per-line arena everything the line needs while it runs is allocated from
+    outfd   :   where output goes when the line has no '>' or '>>' (OUTPUT.txt, or a capture in -j mode)
+    outfile :   target of '>' or '>>' (NULL when the output goes to outfd)
+    outstart:   size of outfile once opened (so that the bytes the line wrote to it are known)
+    procs   :   every process started for the line
+    nprocs  :   number of entries in procs
+    nrunning:   number of processes not reaped yet
+    status  :   wait status of the last command of the line
+    pgid    :   process group of the line with JOB_GROUP (0 until its first process is started)
+    timedout:   the line was killed because it ran for longer than this (ms), 0 otherwise
+    edges   :   the pipes between its stages (not inside #INTERSTART/#INTERSTOP)
+    nedges  :   number of entries in edges
+    spills  :   memory files (memfd) holding the output of the fan-out branches after the first
+                (see struct command), to be appended to the job's output, in order, once it is done
+    nspills :   number of entries in spills
+    infd    :   where the first stage reads from, -1 for the executor's stdin (set by the caller,
+                closed once the stage has it: a line reading the stages of another, see jobs.h)
+    sharefd :   where a fan-out consumer without stages writes (set by the caller, not closed), -1 if none
+    shards  :   number of copies of the pipeline a %PARALLEL line runs (0 for other lines), each
+                of shardstages stages (see startParallel())
+*/
+struct job {
+    int lineno;
+    int flags;
+    struct arena *arena;
+    int outfd;
+    const char *outfile;
+    off_t outstart;
+    struct process *procs;
+    int nprocs;
+    int nrunning;
+    int status;
+    pid_t pgid;
+    int timedout;
+    struct edge *edges;
+    int nedges;
+    int *spills;
+    int nspills;
+    int infd;
+    int sharefd;
+    int shards;
+    int shardstages;
+};
+
+// Most bytes of output written to a job's share file (see struct command)
+#define SHARE_MAX (64 * 1024 * 1024)
+
+// Where the output of the last command of a line goes
+#define REDIRECT_NONE   0   // the job's output (OUTPUT.txt)
+#define REDIRECT_TRUNC  1   // '>'
+#define REDIRECT_APPEND 2   // '>>'
+
+/*
+    A line with its operators already resolved: what execute() works out from the arguments
+    before starting anything.
+
+    stages      :   argv of every command of the pipeline (one when there is no '|'), each NULL-terminated
+    nstages     :   number of entries in stages
+    redirect    :   one of the REDIRECT_ values above
+    redirectfile:   target of '>' or '>>' (when redirect is not REDIRECT_NONE)
+    branches    :   consumers of a fan-out, NULL if the line has none (see below)
+    nbranches   :   number of entries in branches
+
+    The strings are the ones of the arguments the command was compiled from.
+
+    Fan-out: "producer |{ consumer1 ; consumer2 ; ... }" runs the producer (stages, itself a
+    pipeline or a single command) once, and feeds a copy of its output to every consumer. Each
+    consumer is a pipeline of its own, possibly with its own '>' or '>>' (the producer has none).
+    The consumers run at the same time; their outputs reach the job's output in the order they
+    are written in, whichever finishes first. The status of the line is the one of the last
+    command of the last consumer. The operators are tokens of their own, separated by spaces.
+    A consumer without stages (never compiled from a line: --share-prefix builds them, see
+    jobs.h) must be the last one. The producer's output is written to job->sharefd for it, up to
+    SHARE_MAX bytes: past that, nothing more is written to it, and the file is left holding more
+    than SHARE_MAX bytes (at most one pipe's worth more), which says that it is incomplete.
+*/
+struct command {
+    char ***stages;
+    int nstages;
+    int redirect;
+    char *redirectfile;
+    struct command *branches;
+    int nbranches;
+};
+
+// Tokens of the fan-out operator (see struct command)
+#define FANOUT_OPEN  "|{"
+#define FANOUT_NEXT  ";"
+#define FANOUT_CLOSE "}"
+
+
+/*
+    Finds the '|', '>' and '>>' operators in args (as described for execute()) and fills cmd.
+    The stage arrays are allocated from arena a; args itself is not modified.
+*/
+void compileCommand(char **args, struct command *cmd, struct arena *a);
+
+/*
+    Same as execute(), but returns as soon as every process of the line has been started.
+    job->lineno, job->flags, job->arena and job->outfd must be set by the caller. Returns the number of processes started.
+*/
+int startJob(char** args, struct job *job);
+
+// Resets what a job records while it runs (processes, status, target, edges), before it starts
+void clearJob(struct job *job);
+
+// Same as startJob(), for a line compiled with compileCommand()
+int startCommand(struct command *cmd, struct job *job);
+
+/*
+    Fast path for the lines that only copy files: a plain "cat <file>..." (one stage, no options,
+    not reading OUTPUT.txt or its own '>'/'>>' target) is run by the executor itself, with no
+    process started, and the data is copied in the kernel (see copyData()). The output is the
+    one cat would give: a file that can't be read gets "cat: <file>: <error>" (in the output, or
+    on stderr when the output is redirected), the others are still copied, and the exit status is 1.
+
+    isCopyCommand() :   says whether cmd can take the fast path (never when fastPath is 0, --no-fastpath)
+    openCopy()      :   opens the '>'/'>>' target and the files, and sets job->status from what
+                        could be opened. Returns the descriptors (-errno for a file that failed), or
+                        NULL (status 127, as if nothing could be started) if the target can't be opened.
+    runCopy()       :   writes the output: to the target, or else to out (at *off if off isn't NULL
+                        and *off isn't -1). Updates job->status and returns the number of bytes copied.
+
+    The two steps let the caller write the header of the block, which shows the exit status,
+    before the data when there is no redirection.
+*/
+extern int fastPath;
+int isCopyCommand(struct command *cmd);
+int *openCopy(struct command *cmd, struct job *job);
+size_t runCopy(struct command *cmd, struct job *job, int *fds, int out, off_t *off);
+
+/*
+    Pipe transport between the stages of a pipeline.
+
+    Every edge is a fresh pipe2(O_CLOEXEC) (a pipe can't be reused: its reader has seen EOF),
+    with both ends closed in the executor once the stages have them. The edge records come
+    from the job's arena, which is reused by the next lines.
+
+    A pipe starts with the capacity the last pipe written by the same command ended up with
+    (default 64 KiB): commands that produce a lot of data get big pipes right away, and
+    their stages switch between writing and reading less often. While the line runs, the
+    scheduler calls sampleEdges() every EDGE_SAMPLE_MS: a pipe that is full means its writer
+    is waiting for its reader. The time is counted as a stall of the edge, and the pipe is
+    doubled (up to EDGE_MAX_SIZE). The counters are reported by --stats.
+*/
+
+// ms between two looks at how full the pipes of the running pipelines are
+#define EDGE_SAMPLE_MS 20
+
+// Biggest capacity a pipe is grown to (the default /proc/sys/fs/pipe-max-size)
+#define EDGE_MAX_SIZE (1 << 20)
+
+// Called for every process of a job that has exited but is not reaped yet: records what it wrote to its edge
+void stageExited(struct job *job, struct process *p);
+
+// Counts the stalls of the edges of a running job and grows the full ones. Returns the number of edges still watched.
+int sampleEdges(struct job *job);
+
+// Stops watching every edge of the job (also done as the stages are reaped, see jobReaped())
+void closeEdges(struct job *job);
+
+/*
+    Records that pid, one of the job's processes, was reaped with the given wait status and
+    resource usage (as returned by wait4()). Returns 1 once every process of the job has been reaped.
+*/
+int jobReaped(struct job *job, pid_t pid, int status, struct rusage *usage);
+
+// Waits for all processes of a job started with startJob(). Its arena is left to the caller.
+void waitJob(struct job *job);
 
 /*
     Function that handles multiple pipes (with or without redirection at the end).
@@ -46,32 +279,132 @@ int execute(char** args);
     op1             :   pos of '>' ; indicates presence of '>'
     op2             :   pos of '>>' ; indicates presence of '>>'
     redirectfile    :   filename to be used in case of redirection
+    job             :   job the started processes are added to (its outfd is used when there is no redirection)
 
     HOW IT WORKS:
 
-    Iterate through all commands from left to right and use pipe()
-    and dup2() to redirect input and output.
+    Iterate through all commands from left to right, creating a pipe() for every
+    edge between two stages.
 
     fin is descriptor for input
     fout is descriptor for output
 
     According to the commands, we modify fin and fout.
 
-    To execute each command, we use a fork() call and child executes the command.
+    Every stage is started with launchCommand() before any of them is waited on,
+    so all stages run concurrently and data streams through the pipes. The parent
+    closes its copy of each pipe end right after handing it to the child; only then
+    does a reader see EOF when its writer exits. The function returns once all
+    stages are running; the caller reaps the whole group (waitJob()).
+
+    The executor's own stdin/stdout are never modified: the fds are only
+    dup2()-ed inside the children.
+
+    With the fast path (see isCopyCommand()), a first stage that is only "cat <file>" is not
+    started: the file itself is the stdin of the second stage. A '>' or '>>' target is always
+    the stdout of the last stage, without any pipe in between.
     
 */
-void executePipeCommands(char** commands[], int numberOfCommands, int op1, int op2, char* redirectfile);
+void executePipeCommands(char** commands[], int numberOfCommands, int op1, int op2, char* redirectfile, struct job *job);
+
+/*
+    Starts a child that executes argv with fdin, fdout and fderr as its stdin, stdout and stderr.
+    Returns the pid of the child (or -1 if it couldn't be started). Does not wait for it.
+    How the child is created depends on spawnBackend. The command is searched for in PATH
+    once per name: later launches execute the cached absolute path directly.
+    If pgid is not NULL, the child joins process group *pgid, or leads a new one (whose id is
+    stored in *pgid) when it is 0.
+*/
+pid_t launchCommand(char **argv, int fdin, int fdout, int fderr, pid_t *pgid);
+
+// Ways launchCommand() can create a child (selected with --spawn)
+#define SPAWN_FORK  0   // fork() + dup2() + execve()
+#define SPAWN_POSIX 1   // posix_spawn() with dup2 file actions (no page table copy)
+
+extern int spawnBackend;
+
+/*
+    What every line reads as its stdin: the executor's stdin, unless the batch itself is read
+    from it (--stream), where a line reading stdin would eat the next lines of the batch. main()
+    then sets it to /dev/null. Never closed by the functions it is passed to.
+*/
+extern int jobInput;
+
+/*
+    The file a line whose command is name executes: name itself if it contains a '/', else its
+    path in PATH (through the resolved-executable cache, see launchCommand()), or NULL if nothing
+    in PATH matches it.
+*/
+const char *commandPath(const char *name);
+
+/*
+    Counters of the resolved-executable cache (see launchCommand()).
+
+    lookups         :   command names looked up (names containing a '/' are not)
+    hits            :   lookups answered from the cache, without searching PATH
+    invalidations   :   times the cache was emptied because PATH changed
+*/
+struct launchstats {
+    unsigned long lookups;
+    unsigned long hits;
+    unsigned long invalidations;
+};
+
+extern struct launchstats launchStats;
+
+// Prints launchStats (--stats)
+void printLaunchStats(void);
 
 
 // returns the number of pipes in one parsed line of arguments
 int numberOfPipes(char **args);
 
-/* 
-    Helper functions to execute the left-most and right-most commands
-    in a series of piped commands
+/*
+    Copies the data on one edge of a pipeline (between stage edge and edge+1, counting from 1)
+    into INTER.<line>.<edge>.txt using tee() and splice(), so it never passes through userspace.
+    in is the read end of the pipe written by the stage before the edge. Returns the descriptor
+    the stage after the edge must read from. The helper process doing the copy is added to job.
+*/
+int captureEdge(struct job *job, int edge, int in);
 
-    NOTE: These are currently not being used as they do not function as required. 
+/*
+    Sharded lines ("%PARALLEL <n> [<merge>]" before the line, see jobs.h).
+
+    The last argument of the line's first command, when it names a regular file (and no other
+    argument does, see shardedArgument()), is split into up to n byte ranges ending at newlines, found in the mapped file without
+    copying it. n copies of the line's pipeline run at the same time, each reading one range
+    on its stdin in place of the file (a helper process splice()s the range from the file
+    into a pipe). Their outputs are merged into the line's output (or its '>'/'>>' target):
+
+    concat  :   one after the other, in file order (the default). Later shards are buffered by
+                the merging helper while the earlier ones are written.
+    sum     :   the numbers of the outputs are added up, field by field (e.g. the counts of wc),
+                in the layout of the first output.
+    sort    :   "sort -m" of the outputs, with the options that follow (e.g. "sort -n" for
+                pipelines ending with "sort -n"): every output must be sorted the same way.
+
+    The file is read from stdin, so the output is what the line gives for stdin (e.g. no file name
+    after the counts of wc). Lines without a file to split, files too small to be split, and
+    fan-outs run as usual.
+
+    The status of a sharded line is the status of its merge if it failed. Otherwise, it comes from
+    the last commands of the shards: the first error (a status above 1, or a signal) if any, then
+    0 if any of them exited with 0, and 1 only if all of them did (e.g. grep finding nothing).
+*/
+
+// Ways the outputs of the shards are merged
+#define MERGE_CONCAT 0
+#define MERGE_SUM    1
+#define MERGE_SORT   2
+
+// Least bytes per shard: smaller files are split in fewer ranges
+#define SHARD_MIN (64 * 1024)
+
+// Returns the MERGE_ mode named by merge[0] (MERGE_CONCAT if it is NULL), or -1 if it names none
+int mergeMode(char **merge);
+
+/*
+    Same as startCommand(), with the line split into up to shards copies merged as merge says
+    (a MERGE_ mode name, followed by the options of sort for MERGE_SORT).
 */
-void executeLeft(int pipefd[], char** args);
-void executeIntermediate(int pipefd[], char** args);
-void executeRight(int pipefd[], char** args);
\ No newline at end of file
+int startParallel(struct command *cmd, struct job *job, int shards, char **merge);
@@ -0,0 +1,1523 @@
+#define _GNU_SOURCE   // for pipe2() and memfd_create()
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+
+// for open()
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "parse.h"
+#include "execute.h"
+#include "output.h"
+#include "stats.h"
+#include "cache.h"
+#include "journal.h"
+#include "jobs.h"
+
+// States of a job, in the order it goes through them
+#define JOB_WAITING 0   // some dependency has not finished yet, or no free slot
+#define JOB_RUNNING 1   // processes started, not all reaped
+#define JOB_DONE    2   // all processes reaped and output read, waiting to be flushed
+#define JOB_FLUSHED 3   // output queued for OUTPUT.txt, resources released
+
+// One line of the batch file (its place in the graph)
+struct node {
+  int lineno;       // line number in the batch file
+  int section;      // %BEGIN/%END section it is in
+  int flags;        // JOB_ flags
+  char **args;      // owned by the caller (the plan), like cmd: NULL once flushed
+  struct command *cmd;
+  char *label;      // set by %LABEL (the name in the label table)
+  int timeout;      // ms the line may run for (%TIMEOUT or --job-timeout), 0 for no limit
+  int state;
+  int barrier;      // reads OUTPUT.txt: may only start once every earlier line is flushed
+  int written;      // its block was written when it ran (see copyJob())
+  int nocache;      // set by %NOCACHE
+  int parallel;     // shards, set by %PARALLEL (0 for none)
+  char **merge;     // how the shards are merged (see startParallel()), owned by the job
+  int leader;       // --share-prefix: job whose run of the leading stages this one reads (-1 if none)
+  int shared;       // number of leading stages shared with the other jobs of its group
+  int sharers;      // leader: jobs that will read its share file and haven't started yet
+  int sharefd;      // leader: share file (memfd) with the output of the shared stages, -1 until it runs
+  struct command *sharedcmd;  // run instead of cmd by a job of a group (see shareJobs()), owned by the job
+  int store;        // looked up in the result cache and missed: its output is stored if it succeeds
+  unsigned __int128 cachekey;
+  int outfd;        // where the block goes (-1: OUTPUT.txt), see ownJobs()
+  const char *cwd;  // directory it runs in (NULL: the executor's), until it is flushed
+  void *owner;
+  void (*flushed)(void *owner, struct job *job);
+
+  int *deps;        // earlier jobs that must finish first
+  int ndeps, capdeps;
+  int *dependents;  // later jobs waiting for this one
+  int ndependents, capdependents;
+  int pending;      // deps that have not finished yet
+};
+
+/*
+    What a line needs while it runs. Only the jobs from head to head + capacity - 1 can be
+    started, so job i always uses slots[i % capacity], and everything in it is reused
+    by later lines: the memory used while the batch runs doesn't grow with its length (make
+    check measures it). The node of a line (struct node) goes too, once it is flushed (see
+    retireJobs()).
+*/
+struct slot {
+  struct job job;
+  struct capture capture;   // output of the line, read while it runs
+  struct arena arena;       // reset once the line is flushed
+  int timerfd;              // expires at the line's deadline (-1 if it has none)
+  int killed;               // signal sent to the line's process group at the last expiry (0 if none)
+  size_t copied;            // bytes the executor copied itself (see copyJob())
+};
+
+// Last writer and readers since then of one file, used to find the edges of the graph
+struct fileuse {
+  char *name;
+  int writer;       // job that last wrote the file (-1 if none)
+  int *readers;     // jobs that read the file after writer
+  int nreaders, capreaders;
+};
+
+static struct node *jobs;     // jobs from base to njobs - 1 of the batch, in line order (see nodeOf())
+static int base, njobs, capjobs;
+static int retired;           // jobs before this one are flushed and their nodes released
+
+static struct fileuse *files; // open addressing hash table keyed by file name
+static int capfiles, nfiles;
+
+// Latest job with a label, in an open addressing hash table keyed by the label
+struct labeluse {
+  char *name;
+  int job;
+};
+
+static struct labeluse *labels;
+static int caplabels, nlabels;
+
+static char *pendinglabel;    // %LABEL waiting for the next job
+static int *pendingafter;     // %AFTER waiting for the next job
+static int npendingafter, cappendingafter;
+static int pendingtimeout = -1; // %TIMEOUT waiting for the next job (-1 if none)
+static int pendingnocache;    // %NOCACHE waiting for the next job
+static int pendingparallel;   // %PARALLEL waiting for the next job, with its merge
+static char **pendingmerge;
+static int defaulttimeout;    // --job-timeout
+
+static int owneroutfd = -1;   // ownJobs(), for the next jobs
+static const char *ownercwd;
+static void *owner;
+static void (*ownerflushed)(void *owner, struct job *job);
+
+static int sharing;           // shareJobs() was called
+static int sharedlines, savedlaunches;
+
+static int head;              // oldest job not flushed yet
+static int running;           // jobs in JOB_RUNNING
+static int maxrunning;
+static int capacity;          // at most this many jobs past head may be started
+static struct slot *slots;    // capacity of them
+
+/*
+    The reactor: one epoll instance watching the output pipe and a pidfd of every running
+    process, plus a signalfd for SIGCHLD (used for the processes no pidfd could be opened for).
+    The data of every event says what it is about (see event()).
+*/
+static int homefd = -1;       // the executor's own directory, once a job ran elsewhere (see enterDir())
+
+static int epfd = -1;
+static int sigfd = -1;
+static int unwatched;         // running processes without a pidfd
+
+#define EV_OUTPUT   0   // output pipe of job
+#define EV_PROCESS  1   // pidfd of process proc of job
+#define EV_SIGCHLD  2
+#define EV_TIMER    3   // deadline of job
+#define EV_INPUT    4   // descriptor fd (in place of job) given to watchInput()
+#define EV_SAMPLE   5   // time to look at the pipes of the running pipelines (sampleEdges())
+
+static int samplefd = -1;     // timerfd expiring every EDGE_SAMPLE_MS while there are edges to watch
+static int sampling;
+
+// A descriptor given to watchInput()
+struct input {
+  int fd;
+  int wanted;       // stepJobs() wakes up when it is readable
+  int writable;     // stepJobs() wakes up when it is writable (watchOutput())
+  int always;       // can't be polled (regular file): it is always readable
+};
+
+static struct input *inputs;
+static int ninputs, capinputs;
+static int *readyinputs;      // filled by stepJobs(): descriptors that became readable
+static int nready, maxready;
+static sigset_t oldsigmask;   // signal mask before beginJobs()
+
+#define event(kind, job, proc) ((uint64_t)(kind) << 56 | (uint64_t)(proc) << 32 | (uint32_t)(job))
+#define eventKind(ev) ((int)((ev) >> 56))
+#define eventProc(ev) ((int)(((ev) >> 32) & 0xffffff))
+#define eventJob(ev) ((int)(uint32_t)(ev))
+
+// Events handled per epoll_wait()
+#define JOB_EVENTS 64
+
+#define slotOf(i) (&slots[(i) % capacity])
+
+// Node of job i, which must not be retired yet
+#define nodeOf(i) (&jobs[(i) - base])
+
+// Whether job i has finished: an edge from it has nothing to wait for
+#define isDone(i) ((i) < retired || nodeOf(i)->state >= JOB_DONE)
+
+
+static void *allocOrDie(void *p) {
+  if(!p) {
+    printf("Memory allocation unsuccessful! Exiting...\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+// Appends x to a growable array of ints
+static void pushInt(int **v, int *n, int *cap, int x) {
+  if(*n == *cap) {
+    *cap = *cap ? *cap * 2 : 4;
+    *v = (int*)allocOrDie(realloc(*v, *cap * sizeof(int)));
+  }
+  (*v)[(*n)++] = x;
+}
+
+// Makes job j depend on the earlier job i (duplicates are ignored)
+static void addEdge(int i, int j) {
+  int k;
+
+  if(i < 0 || i >= j) return;
+  if(isDone(i)) return;   // already finished (lines added while the batch runs)
+  for(k=0; k<nodeOf(j)->ndeps; k++)
+    if(nodeOf(j)->deps[k] == i) return;
+
+  pushInt(&nodeOf(j)->deps, &nodeOf(j)->ndeps, &nodeOf(j)->capdeps, i);
+  pushInt(&nodeOf(i)->dependents, &nodeOf(i)->ndependents, &nodeOf(i)->capdependents, j);
+}
+
+// FNV-1a
+static unsigned long hashName(const char *s) {
+  unsigned long h = 14695981039346656037UL;
+  while(*s) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211UL;
+  }
+  return h;
+}
+
+// Drops the readers of a file that have finished: no edge comes from them anymore
+static void pruneReaders(struct fileuse *f) {
+  int k, n = 0;
+
+  for(k=0; k<f->nreaders; k++)
+    if(!isDone(f->readers[k])) f->readers[n++] = f->readers[k];
+  f->nreaders = n;
+}
+
+/*
+    Whether the entry of a file can be dropped: its last writer and the readers since then have
+    all finished, so the next job naming it gets no edge from it (as for a file never named before).
+*/
+static int fileDone(struct fileuse *f) {
+  if(f->writer >= 0 && !isDone(f->writer)) return 0;
+  pruneReaders(f);
+  return f->nreaders == 0;
+}
+
+// Returns the entry of a file in the table, adding it if needed
+static struct fileuse *lookupFile(const char *name) {
+  struct fileuse *old;
+  int oldcap, i, kept = 0;
+  unsigned long h;
+
+  // "./x" and "x" are the same file
+  while(name[0] == '.' && name[1] == '/') name += 2;
+
+  // Rebuilt without the files no running or waiting job names, and only grown if it
+  // is still more than a quarter full (lines added while the batch runs keep it small)
+  if(2 * (nfiles + 1) > capfiles) {
+    for(i=0; i<capfiles; i++) {
+      if(!files[i].name) continue;
+      if(fileDone(&files[i])) {
+        free(files[i].name);
+        free(files[i].readers);
+        files[i].name = NULL;
+      }
+      else kept++;
+    }
+
+    old = files;
+    oldcap = capfiles;
+    if(capfiles == 0) capfiles = 64;
+    else if(4 * (kept + 1) > capfiles) capfiles *= 2;
+    files = (struct fileuse*)allocOrDie(calloc(capfiles, sizeof(struct fileuse)));
+    for(i=0; i<oldcap; i++) {
+      if(!old[i].name) continue;
+      h = hashName(old[i].name) & (capfiles - 1);
+      while(files[h].name) h = (h + 1) & (capfiles - 1);
+      files[h] = old[i];
+    }
+    free(old);
+    nfiles = kept;
+  }
+
+  h = hashName(name) & (capfiles - 1);
+  while(files[h].name) {
+    if(strcmp(files[h].name, name) == 0) return &files[h];
+    h = (h + 1) & (capfiles - 1);
+  }
+
+  files[h].name = (char*)allocOrDie(strdup(name));
+  files[h].writer = -1;
+  nfiles++;
+  return &files[h];
+}
+
+/*
+    The name job j's files are known by in the table: a relative name is joined to the directory
+    of a job that runs somewhere else than the executor (see ownJobs()), so that the same file
+    named from two directories is one entry. Uses buf (PATH_MAX bytes) if it has to.
+*/
+static const char *fileKey(int j, const char *name, char *buf) {
+  const char *cwd = nodeOf(j)->cwd;
+
+  if(cwd == NULL || name[0] == '/') return name;
+  while(name[0] == '.' && name[1] == '/') name += 2;
+  if(snprintf(buf, PATH_MAX, "%s/%s", cwd, name) >= PATH_MAX) return name;
+  return buf;
+}
+
+// Job j reads the file: it must run after the last job that wrote it
+static void readsFile(int j, const char *name) {
+  char buf[PATH_MAX];
+  struct fileuse *f = lookupFile(fileKey(j, name, buf));
+
+  addEdge(f->writer, j);
+  if(f->nreaders == f->capreaders) pruneReaders(f);
+  pushInt(&f->readers, &f->nreaders, &f->capreaders, j);
+}
+
+// Job j writes the file: it must run after the last writer and every reader since then
+static void writesFile(int j, const char *name) {
+  char buf[PATH_MAX];
+  struct fileuse *f = lookupFile(fileKey(j, name, buf));
+  int k;
+
+  addEdge(f->writer, j);
+  for(k=0; k<f->nreaders; k++)
+    addEdge(f->readers[k], j);
+
+  f->writer = j;
+  f->nreaders = 0;
+}
+
+/*
+    Adds the edges of job j from the files it names. The target of '>' or '>>' is written,
+    every other argument (except the command name of each stage) is taken to be a file that is read.
+*/
+static void addFileEdges(int j) {
+  char **args = nodeOf(j)->args;
+  int i;
+  int first = 1;    // next argument is the command name of a stage
+
+  for(i=0; args[i] != NULL; i++) {
+    if(strcmp(args[i], "|") == 0 || strcmp(args[i], FANOUT_OPEN) == 0 || strcmp(args[i], FANOUT_NEXT) == 0) { first = 1; continue; }
+    if(strcmp(args[i], FANOUT_CLOSE) == 0) continue;
+
+    if(strcmp(args[i], ">") == 0 || strcmp(args[i], ">>") == 0) {
+      if(args[i+1] != NULL) {
+        if(strcmp(args[i+1], "OUTPUT.txt") == 0) nodeOf(j)->barrier = 1;
+        writesFile(j, args[i+1]);
+        i++;
+      }
+      continue;
+    }
+
+    if(first) { first = 0; continue; }
+
+    if(strcmp(args[i], "OUTPUT.txt") == 0) nodeOf(j)->barrier = 1;
+    readsFile(j, args[i]);
+  }
+}
+
+// Copy of the NULL-terminated args, in memory of its own
+static char **copyArgs(char **args) {
+  char **copy;
+  int i, n;
+
+  for(n=0; args[n] != NULL; n++)
+    ;
+  copy = (char**)allocOrDie(malloc((n + 1) * sizeof(char*)));
+  for(i=0; i<n; i++) copy[i] = (char*)allocOrDie(strdup(args[i]));
+  copy[n] = NULL;
+  return copy;
+}
+
+static void freeArgs(char **args) {
+  int i;
+
+  if(args == NULL) return;
+  for(i=0; args[i] != NULL; i++) free(args[i]);
+  free(args);
+}
+
+// Returns the entry of a label in the table (with a NULL name if no job has it yet)
+static struct labeluse *lookupLabel(const char *label) {
+  struct labeluse *old;
+  int oldcap, i;
+  unsigned long h;
+
+  if(2 * (nlabels + 1) > caplabels) {
+    old = labels;
+    oldcap = caplabels;
+    caplabels = caplabels ? caplabels * 2 : 16;
+    labels = (struct labeluse*)allocOrDie(calloc(caplabels, sizeof(struct labeluse)));
+    for(i=0; i<oldcap; i++) {
+      if(!old[i].name) continue;
+      h = hashName(old[i].name) & (caplabels - 1);
+      while(labels[h].name) h = (h + 1) & (caplabels - 1);
+      labels[h] = old[i];
+    }
+    free(old);
+  }
+
+  h = hashName(label) & (caplabels - 1);
+  while(labels[h].name && strcmp(labels[h].name, label) != 0)
+    h = (h + 1) & (caplabels - 1);
+  return &labels[h];
+}
+
+// Returns the index of the latest job with the given label, or -1
+static int findLabel(const char *label) {
+  struct labeluse *l = lookupLabel(label);
+  return l->name ? l->job : -1;
+}
+
+void initJobs(int maxjobs, double timeout) {
+  int i;
+
+  maxrunning = maxjobs;
+  capacity = maxjobs * JOB_WINDOW;
+  defaulttimeout = timeout * 1000;
+
+  slots = (struct slot*)allocOrDie(calloc(capacity, sizeof(struct slot)));
+  for(i=0; i<capacity; i++) slots[i].timerfd = -1;
+}
+
+int jobDirective(char **args) {
+  int i;
+
+  if(strcmp(args[0], "%LABEL") == 0 || strcmp(args[0], "%AFTER") == 0) {
+    if(args[1] == NULL) {
+      printf("Missing label name: %s\n", args[0]);
+      return 1;
+    }
+
+    if(args[0][1] == 'L') {
+      free(pendinglabel);
+      pendinglabel = (char*)allocOrDie(strdup(args[1]));
+    }
+    else if((i = findLabel(args[1])) < 0)
+      printf("%%AFTER %s: no earlier line has this label, ignored\n", args[1]);
+    else
+      pushInt(&pendingafter, &npendingafter, &cappendingafter, i);
+
+    return 1;
+  }
+
+  if(strcmp(args[0], "%TIMEOUT") == 0) {
+    char *end = NULL;
+    double secs = args[1] ? strtod(args[1], &end) : -1;
+
+    if(args[1] == NULL || *end != '\0' || secs < 0)
+      printf("%%TIMEOUT needs a number of seconds (0 for no limit), ignored\n");
+    else
+      pendingtimeout = secs * 1000;
+
+    return 1;
+  }
+
+  if(strcmp(args[0], "%NOCACHE") == 0) {
+    pendingnocache = 1;
+    return 1;
+  }
+
+  if(strcmp(args[0], "%PARALLEL") == 0) {
+    char *end = NULL;
+    long shards = args[1] ? strtol(args[1], &end, 10) : 0;
+
+    if(args[1] == NULL || *end != '\0' || shards < 1 || mergeMode(args + 2) < 0) {
+      printf("%%PARALLEL needs a number of shards, then concat, sum or sort [options], ignored\n");
+      return 1;
+    }
+
+    freeArgs(pendingmerge);
+    pendingparallel = shards;
+    pendingmerge = copyArgs(args + 2);
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+    Releases the nodes of the flushed jobs at the head of the batch, from the oldest on. A
+    leader whose share file is still to be read by a later job (see shareJobs()) keeps its node,
+    and the ones after it, until that job has started.
+*/
+static void retireJobs(void) {
+  struct node *n;
+
+  while(retired < head && nodeOf(retired)->sharers == 0) {
+    n = nodeOf(retired);
+    freeArgs(n->merge);
+    free(n->sharedcmd);
+    if(n->sharefd >= 0) close(n->sharefd);
+    free(n->deps);
+    free(n->dependents);
+    retired++;
+  }
+}
+
+// Marks job i as flushed: its line (args, cmd) is no longer used, and its owner is told (see ownJobs())
+static void flushedJob(int i, struct job *job) {
+  struct node *n = nodeOf(i);
+
+  n->state = JOB_FLUSHED;
+  n->args = NULL;
+  n->cmd = NULL;
+  n->cwd = NULL;
+  if(n->flushed) n->flushed(n->owner, job);
+}
+
+void ownJobs(int outfd, const char *cwd, void *o, void (*flushed)(void *owner, struct job *job)) {
+  owneroutfd = outfd;
+  ownercwd = cwd;
+  owner = o;
+  ownerflushed = flushed;
+}
+
+void addJob(char **args, struct command *cmd, int lineno, int section, int flags) {
+  struct node *n;
+  struct labeluse *l;
+  int j, k;
+
+  // The released nodes at the front make room, once they are at least half of the array
+  if(njobs - base == capjobs) {
+    if(2 * (retired - base) >= capjobs && capjobs > 0) {
+      memmove(jobs, nodeOf(retired), (njobs - retired) * sizeof(struct node));
+      base = retired;
+    }
+    else {
+      capjobs = capjobs ? capjobs * 2 : 64;
+      jobs = (struct node*)allocOrDie(realloc(jobs, capjobs * sizeof(struct node)));
+    }
+  }
+
+  j = njobs++;
+  n = nodeOf(j);
+  memset(n, 0, sizeof(*n));
+
+  n->lineno = lineno;
+  n->section = section;
+  n->flags = flags;
+  n->args = args;
+  n->cmd = cmd;
+
+  // The table keeps one name per label: the latest job with it is the one %AFTER finds
+  if(pendinglabel) {
+    l = lookupLabel(pendinglabel);
+    if(l->name) free(pendinglabel);
+    else {
+      l->name = pendinglabel;
+      nlabels++;
+    }
+    l->job = j;
+    n->label = l->name;
+    pendinglabel = NULL;
+  }
+
+  n->timeout = pendingtimeout >= 0 ? pendingtimeout : defaulttimeout;
+  pendingtimeout = -1;
+
+  n->nocache = pendingnocache;
+  pendingnocache = 0;
+
+  n->leader = -1;
+  n->sharefd = -1;
+
+  n->parallel = pendingparallel;
+  n->merge = pendingmerge;
+  pendingparallel = 0;
+  pendingmerge = NULL;
+
+  n->outfd = owneroutfd;
+  n->cwd = ownercwd;
+  n->owner = owner;
+  n->flushed = ownerflushed;
+
+  for(k=0; k<npendingafter; k++)
+    addEdge(pendingafter[k], j);
+  npendingafter = 0;
+
+  addFileEdges(j);
+
+  n->pending = n->ndeps;
+
+  // Done before the run that died (--resume): its block is already in OUTPUT.txt
+  if(head == j && journalDone(j, lineno, args)) {
+    head++;
+    flushedJob(j, NULL);
+  }
+}
+
+// Marks job i as finished, which may make later jobs ready
+static void finishJob(int i) {
+  struct slot *s = slotOf(i);
+  int k;
+
+  if(s->timerfd >= 0) {
+    close(s->timerfd);    // also removes it from the epoll set
+    s->timerfd = -1;
+  }
+
+  nodeOf(i)->state = JOB_DONE;
+  for(k=0; k<nodeOf(i)->ndependents; k++)
+    nodeOf(nodeOf(i)->dependents[k])->pending--;
+}
+
+// Jobs from head up to (not including) this one are the only ones that may have been started
+static int windowEnd(void) {
+  return head + capacity < njobs ? head + capacity : njobs;
+}
+
+static void watch(int fd, uint64_t ev) {
+  struct epoll_event e;
+
+  memset(&e, 0, sizeof(e));
+  e.events = EPOLLIN;
+  e.data.u64 = ev;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) < 0) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Makes the timer expire once, ms from now
+static void armTimer(int fd, int ms) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (long)(ms % 1000) * 1000000;
+  if(its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+  timerfd_settime(fd, 0, &its, NULL);
+}
+
+/*
+    Watches the output and every process of job i, which has just been started. A pidfd
+    becomes readable when its process exits (even if that already happened); processes
+    that can't get one (old kernel, out of descriptors) are reaped through SIGCHLD instead.
+*/
+static void watchJob(int i) {
+  struct job *job = &slotOf(i)->job;
+  struct itimerspec its;
+  int k;
+
+  if(slotOf(i)->capture.fd >= 0) watch(slotOf(i)->capture.fd, event(EV_OUTPUT, i, 0));
+
+  for(k=0; k<job->nprocs; k++) {
+#ifdef SYS_pidfd_open
+    job->procs[k].pidfd = syscall(SYS_pidfd_open, job->procs[k].pid, 0);
+#else
+    job->procs[k].pidfd = -1;
+#endif
+    if(job->procs[k].pidfd >= 0) watch(job->procs[k].pidfd, event(EV_PROCESS, i, k));
+    else unwatched++;
+  }
+
+  // The pipes between its stages are looked at every EDGE_SAMPLE_MS while it runs (see sampleEdges())
+  if(job->nedges > 0 && !sampling && samplefd >= 0) {
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = EDGE_SAMPLE_MS * 1000000L;
+    timerfd_settime(samplefd, 0, &its, NULL);
+    sampling = 1;
+  }
+
+  if(nodeOf(i)->timeout > 0 && job->pgid > 0) {
+    slotOf(i)->killed = 0;
+    slotOf(i)->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if(slotOf(i)->timerfd < 0) perror("timerfd_create");
+    else {
+      armTimer(slotOf(i)->timerfd, nodeOf(i)->timeout);
+      watch(slotOf(i)->timerfd, event(EV_TIMER, i, 0));
+    }
+  }
+}
+
+// Writes the queued blocks to their destination: OUTPUT.txt, or the descriptor of their owner
+static void flushTo(int outfd) {
+  if(outfd < 0) flushOutput();
+  else flushOutputTo(outfd);
+}
+
+// Moves the executor into the directory of job n, if it has one (see ownJobs()). Returns -1 if it can't.
+static int enterDir(struct node *n) {
+  if(n->cwd == NULL) return 0;
+  if(homefd < 0 && (homefd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    perror("Executor directory");
+    return -1;
+  }
+  if(chdir(n->cwd) < 0) {
+    perror(n->cwd);
+    return -1;
+  }
+  return 0;
+}
+
+// Back to the executor's own directory after enterDir(n)
+static void leaveDir(struct node *n) {
+  if(n->cwd != NULL && fchdir(homefd) < 0) perror("Executor directory");
+}
+
+/*
+    Runs job i, a plain cat (see isCopyCommand()), in the executor itself. Without redirection,
+    it must be the next job to be written: its block goes out right away, with the files copied
+    straight into OUTPUT.txt (or the connection of its owner) after the header.
+*/
+static void copyJob(int i) {
+  struct node *n = nodeOf(i);
+  struct slot *s = slotOf(i);
+  int *fds;
+  int out = n->outfd;
+  off_t off = -1;
+
+  s->job.lineno = n->lineno;
+  s->job.flags = n->flags;
+  s->job.arena = &s->arena;
+  s->capture.fd = -1;
+  s->capture.nchunks = 0;
+  s->copied = 0;
+
+  fds = openCopy(n->cmd, &s->job);
+
+  if(n->cmd->redirect == REDIRECT_NONE) {
+    queueBlock(&s->capture, n->lineno, s->job.status, 0);
+    flushTo(n->outfd);
+    if(out < 0) out = outputEnd(&off);
+    n->written = 1;
+  }
+
+  if(fds) s->copied = runCopy(n->cmd, &s->job, fds, out, &off);
+
+  finishJob(i);
+}
+
+/*
+    Looks job i up in the result cache (see cache.h). On a hit, the job is finished without
+    starting anything: its entry is read into its capture (as if the line had written it) or
+    written to its '>'/'>>' target, and 1 is returned. On a miss, the job is marked for its
+    output to be stored once it has run.
+*/
+static int cachedJob(int i) {
+  struct node *n = nodeOf(i);
+  struct slot *s = slotOf(i);
+  const char *target;
+  int fd, out;
+  off_t off, start;
+
+  if(n->nocache || n->parallel || (n->flags & JOB_INTER) || !cacheKey(n->args, &n->cachekey)) {
+    cacheSkipped();
+    return 0;
+  }
+
+  if((fd = cacheLookup(n->cachekey)) < 0) {
+    n->store = 1;
+    return 0;
+  }
+
+  s->job.lineno = n->lineno;
+  s->job.flags = n->flags;
+  s->job.arena = &s->arena;
+  clearJob(&s->job);
+  s->capture.nchunks = 0;
+  s->capture.used = 0;
+  s->copied = 0;
+
+  if(n->cmd->redirect == REDIRECT_NONE) {
+    s->capture.fd = fd;
+    drainCapture(&s->capture);    // reads it all (a file never says EAGAIN) and closes it
+  }
+  else {
+    // Not O_APPEND, which copy_file_range() refuses: '>>' writes at the end itself
+    s->capture.fd = -1;
+    target = n->cmd->redirectfile;
+    out = open(target, O_WRONLY | O_CREAT | O_CLOEXEC | (n->cmd->redirect == REDIRECT_APPEND ? 0 : O_TRUNC), 0644);
+    start = off = out >= 0 ? lseek(out, 0, SEEK_END) : -1;
+    if(out < 0 || copyData(fd, out, &off) < 0) {
+      perror(target);
+      s->job.status = 1 << 8;
+    }
+    else s->copied = off - start;
+    if(out >= 0) close(out);
+    close(fd);
+  }
+
+  finishJob(i);
+  return 1;
+}
+
+/*
+    Stores the output of job i, which missed the result cache and has just finished successfully:
+    its capture (before it is queued) or what it added to its target.
+*/
+static void storeJob(int i) {
+  struct node *n = nodeOf(i);
+  struct slot *s = slotOf(i);
+  int fd = cacheCreate();
+  int in, ok = fd >= 0;
+
+  if(ok && n->cmd->redirect == REDIRECT_NONE) ok = saveCapture(&s->capture, fd) == 0;
+  else if(ok) {
+    // Output that went to OUTPUT.txt as well as to the target can't be replayed from one entry
+    ok = captureSize(&s->capture) == 0 && s->job.outfile != NULL && (in = open(s->job.outfile, O_RDONLY | O_CLOEXEC)) >= 0;
+    if(ok) {
+      ok = lseek(in, s->job.outstart, SEEK_SET) >= 0 && copyData(in, fd, NULL) >= 0;
+      close(in);
+    }
+  }
+
+  cacheCommit(fd, n->cachekey, ok);
+}
+
+/*
+    What job i runs (see shareJobs()), with the share file of its group handed to its job: the
+    leader runs the shared stages as a fan-out to the rest of its line and to the share file,
+    the others run the rest of their line on the share file. Without the share file (the leader
+    was replayed from the cache, or it couldn't be created), or with a share file that got more
+    than SHARE_MAX bytes (it is incomplete, see struct command), the whole line runs.
+*/
+static struct command *shareJob(int i) {
+  struct node *n = nodeOf(i);
+  struct job *job = &slotOf(i)->job;
+  struct stat st;
+  char path[64];
+
+  if(n->leader < 0 && n->sharers > 0) {
+    if((n->sharefd = memfd_create("shared", MFD_CLOEXEC)) < 0) {
+      perror("memfd_create");
+      return n->cmd;
+    }
+    job->sharefd = n->sharefd;
+    // The fan-out helper is one launch more than the line alone
+    savedlaunches--;
+    return n->sharedcmd;
+  }
+
+  if(n->leader >= 0 && nodeOf(n->leader)->sharefd >= 0 &&
+     fstat(nodeOf(n->leader)->sharefd, &st) == 0 && st.st_size <= SHARE_MAX) {
+    // Opened again, not dup()ed: every reader has an offset of its own
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", nodeOf(n->leader)->sharefd);
+    if((job->infd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+      sharedlines++;
+      savedlaunches += n->shared;
+      return n->sharedcmd;
+    }
+  }
+
+  return n->cmd;
+}
+
+// Job i of a group no longer needs the share file: it is closed once no job will read it
+static void releaseShare(int i) {
+  struct node *l;
+
+  if(nodeOf(i)->leader < 0) return;
+  l = nodeOf(nodeOf(i)->leader);
+  if(--l->sharers == 0 && l->sharefd >= 0) {
+    close(l->sharefd);
+    l->sharefd = -1;
+  }
+}
+
+// Finishes job i without running it, as a line whose command failed (exit status 1)
+static void failJob(int i) {
+  struct node *n = nodeOf(i);
+  struct slot *s = slotOf(i);
+
+  s->job.lineno = n->lineno;
+  s->job.flags = n->flags;
+  s->job.arena = &s->arena;
+  clearJob(&s->job);
+  s->job.status = 1 << 8;
+  s->capture.fd = -1;
+  s->capture.nchunks = 0;
+  s->capture.used = 0;
+  s->copied = 0;
+  releaseShare(i);
+  finishJob(i);
+}
+
+/*
+    Starts job i, which is ready, or finishes it right away (copy, cache hit). Returns -1 if it
+    can't be started for lack of descriptors: it is tried again once a job has finished.
+*/
+static int launchJob(int i) {
+  struct node *n = nodeOf(i);
+  struct slot *s = slotOf(i);
+  int started;
+
+  // Copies that would go to OUTPUT.txt wait until they are next (otherwise cat runs)
+  // (and copies for a client, whose connection is written without waiting: see flushOutputTo())
+  if(!n->parallel && isCopyCommand(n->cmd) && (n->cmd->redirect != REDIRECT_NONE || (i == head && n->outfd < 0))) {
+    copyJob(i);
+    if(cacheEnabled()) cacheSkipped();
+    return 0;
+  }
+
+  if(cacheEnabled() && cachedJob(i)) {
+    releaseShare(i);
+    return 0;
+  }
+
+  s->copied = 0;
+  s->job.lineno = n->lineno;
+  s->job.flags = n->flags | (n->timeout > 0 ? JOB_GROUP : 0);
+  s->job.arena = &s->arena;
+  s->job.infd = -1;
+  s->job.sharefd = -1;
+
+  s->job.outfd = startCapture(&s->capture);
+  if(s->job.outfd < 0) return -1;
+
+  if(n->parallel)
+    started = startParallel(n->cmd, &s->job, n->parallel, n->merge);
+  else
+    started = startCommand(shareJob(i), &s->job);
+  if(started == 0)
+    s->job.status = 127 << 8;     // nothing could be started, as if the exec had failed
+  releaseShare(i);
+
+  // Only the processes of the line hold the write end now: the capture
+  // sees EOF once all of them are done.
+  close(s->job.outfd);
+
+  watchJob(i);
+
+  n->state = JOB_RUNNING;
+  running++;
+  return 0;
+}
+
+// Starts every ready job, lowest line first, while there are free slots
+static void startReady(void) {
+  int i, started;
+  int end = windowEnd();
+  struct node *n;
+
+  for(i=head; i<end && running < maxrunning; i++) {
+    n = nodeOf(i);
+    if(n->state != JOB_WAITING || n->pending > 0) continue;
+    if(n->barrier && i != head) continue;
+
+    // The executor is in the job's directory while it starts it: its processes start there,
+    // and the files the executor opens for it (targets, copies, cache keys) are found there
+    if(enterDir(n) < 0) {
+      failJob(i);
+      continue;
+    }
+    started = launchJob(i);
+    leaveDir(n);
+    if(started < 0) return;
+  }
+}
+
+// Queues the output of the finished jobs at the head of the batch and writes it to OUTPUT.txt
+static void flushJobs(void) {
+  int first = head;
+  off_t end = 0;    // size of OUTPUT.txt once the blocks queued so far are written
+  size_t size;
+  int i;
+
+  if(journalEnabled() && head < njobs && nodeOf(head)->state == JOB_DONE) end = outputSize();
+
+  while(head < njobs && nodeOf(head)->state == JOB_DONE) {
+    // Blocks only share a writev() with the blocks going to the same place
+    if(head > first && nodeOf(head)->outfd != nodeOf(head - 1)->outfd) flushTo(nodeOf(head - 1)->outfd);
+
+    recordJob(&slotOf(head)->job, captureSize(&slotOf(head)->capture) + slotOf(head)->copied);
+    if(nodeOf(head)->store && slotOf(head)->job.status == 0 && !slotOf(head)->job.timedout && enterDir(nodeOf(head)) == 0) {
+      storeJob(head);
+      leaveDir(nodeOf(head));
+    }
+    size = nodeOf(head)->written ? 0 :
+           queueBlock(&slotOf(head)->capture, nodeOf(head)->lineno, slotOf(head)->job.status, slotOf(head)->job.timedout);
+    if(journalEnabled() && nodeOf(head)->outfd < 0) {
+      end += size;
+      journalLine(head, nodeOf(head)->lineno, nodeOf(head)->args, slotOf(head)->job.status, end);
+    }
+    head++;
+  }
+
+  if(head == first) return;
+
+  flushTo(nodeOf(head - 1)->outfd);
+  journalCommit(0);
+
+  // The blocks are written: the slots of these jobs can be used by the next ones
+  for(i=first; i<head; i++) {
+    flushedJob(i, &slotOf(i)->job);
+    arenaReset(&slotOf(i)->arena);
+  }
+  retireJobs();
+}
+
+// Job i is finished once all its processes are reaped and its output pipe is at EOF
+static void checkFinished(int i) {
+  struct slot *s = slotOf(i);
+  int k;
+
+  if(nodeOf(i)->state == JOB_RUNNING && s->job.nrunning == 0 && s->capture.fd < 0) {
+    // The outputs of its fan-out consumers after the first one follow, in order (a file is read at once)
+    for(k=0; k<s->job.nspills; k++) {
+      s->capture.fd = s->job.spills[k];
+      if(lseek(s->capture.fd, 0, SEEK_SET) == 0) drainCapture(&s->capture);
+      else close(s->capture.fd);
+      s->capture.fd = -1;
+    }
+    s->job.nspills = 0;
+
+    finishJob(i);
+    running--;
+  }
+}
+
+// Hands the exit of process k of job i to its job, and stops watching the process
+static void processExited(int i, int k, int status, struct rusage *usage) {
+  struct job *job = &slotOf(i)->job;
+  struct process *p = &job->procs[k];
+
+  if(p->pidfd >= 0) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, p->pidfd, NULL);
+    close(p->pidfd);
+    p->pidfd = -1;
+  }
+  else unwatched--;
+
+  jobReaped(job, p->pid, status, usage);
+  checkFinished(i);
+}
+
+// The pidfd of process k of job i is readable: the process has exited and can be reaped
+static void reapProcess(int i, int k) {
+  struct process *p;
+  struct rusage usage;
+  int status;
+  pid_t pid;
+
+  if(nodeOf(i)->state != JOB_RUNNING || k >= slotOf(i)->job.nprocs) return;
+  p = &slotOf(i)->job.procs[k];
+  if(p->reaped || p->pidfd < 0) return;
+
+  stageExited(&slotOf(i)->job, p);
+
+  while((pid = wait4(p->pid, &status, WNOHANG, &usage)) < 0 && errno == EINTR)
+    ;
+  if(pid == p->pid) processExited(i, k, status, &usage);
+}
+
+/*
+    Reaps every child that has exited and hands it to the job it belongs to. Only needed
+    for the processes without a pidfd, which are found by their pid in the running jobs.
+*/
+static void reapChildren(void) {
+  pid_t pid;
+  int status;
+  struct rusage usage;
+  struct job *job;
+  int i, k;
+
+  while(unwatched > 0 && (pid = wait4(-1, &status, WNOHANG, &usage)) != 0) {
+    if(pid < 0) {
+      if(errno == EINTR) continue;
+      // No children left: nothing we are waiting for can exit anymore
+      unwatched = 0;
+      for(i=head; i<windowEnd(); i++) {
+        if(nodeOf(i)->state != JOB_RUNNING) continue;
+        slotOf(i)->job.nrunning = 0;
+        checkFinished(i);
+      }
+      return;
+    }
+
+    for(i=head; i<windowEnd(); i++) {
+      if(nodeOf(i)->state != JOB_RUNNING) continue;
+      job = &slotOf(i)->job;
+      for(k=0; k<job->nprocs; k++)
+        if(job->procs[k].pid == pid && !job->procs[k].reaped) break;
+      if(k < job->nprocs) {
+        processExited(i, k, status, &usage);
+        break;
+      }
+    }
+  }
+}
+
+/*
+    The deadline of job i has passed: its process group gets SIGTERM, and if it is still
+    running JOB_KILL_GRACE ms later, SIGKILL.
+*/
+static void jobExpired(int i) {
+  struct slot *s = slotOf(i);
+  uint64_t expirations;
+
+  if(nodeOf(i)->state != JOB_RUNNING || s->timerfd < 0) return;
+  read(s->timerfd, &expirations, sizeof(expirations));
+
+  // Once every process is reaped, the group id may belong to someone else
+  if(s->job.nrunning == 0) return;
+
+  s->job.timedout = nodeOf(i)->timeout;
+
+  if(s->killed == 0) {
+    s->killed = SIGTERM;
+    kill(-s->job.pgid, SIGTERM);
+    armTimer(s->timerfd, JOB_KILL_GRACE);
+  }
+  else if(s->killed == SIGTERM) {
+    s->killed = SIGKILL;
+    kill(-s->job.pgid, SIGKILL);
+  }
+}
+
+// Samples the edges of every running pipeline, and stops the timer once none is left
+static void sampleJobs(void) {
+  struct itimerspec its;
+  uint64_t expirations;
+  int i, n = 0;
+
+  read(samplefd, &expirations, sizeof(expirations));
+
+  for(i=head; i<windowEnd(); i++)
+    if(nodeOf(i)->state == JOB_RUNNING) n += sampleEdges(&slotOf(i)->job);
+
+  if(n == 0) {
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(samplefd, 0, &its, NULL);
+    sampling = 0;
+  }
+}
+
+/*
+    Waits (at most timeout ms, -1 for no limit) until a child exits or a running job's output
+    can be read, and handles it.
+    Children are reaped in the order they exit, whichever job they belong to.
+*/
+static void waitEvents(int timeout) {
+  struct epoll_event events[JOB_EVENTS];
+  struct signalfd_siginfo info;
+  int n, i;
+  uint64_t ev;
+
+  n = epoll_wait(epfd, events, JOB_EVENTS, timeout);
+
+  for(i=0; i<n; i++) {
+    ev = events[i].data.u64;
+
+    switch(eventKind(ev)) {
+      case EV_OUTPUT:
+        if(nodeOf(eventJob(ev))->state != JOB_RUNNING || slotOf(eventJob(ev))->capture.fd < 0) break;
+        if(drainCapture(&slotOf(eventJob(ev))->capture)) checkFinished(eventJob(ev));
+        break;
+      case EV_PROCESS:
+        reapProcess(eventJob(ev), eventProc(ev));
+        break;
+      case EV_SIGCHLD:
+        while(read(sigfd, &info, sizeof(info)) > 0)
+          ;
+        reapChildren();
+        break;
+      case EV_TIMER:
+        jobExpired(eventJob(ev));
+        break;
+      case EV_SAMPLE:
+        sampleJobs();
+        break;
+      case EV_INPUT:
+        if(nready < maxready) readyinputs[nready++] = eventJob(ev);
+        break;
+    }
+  }
+}
+
+void beginJobs(const char *output) {
+  sigset_t set;
+
+  // The executor is the only writer of OUTPUT.txt (see output.h), which keeps the blocks of the
+  // lines done before with --resume (see journal.h)
+  if(output) openOutput(output, journalStart(output));
+
+  // SIGCHLD is only received through the signalfd (children get an empty mask, see launchCommand())
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, &oldsigmask);
+
+  if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 || (sigfd = signalfd(-1, &set, SFD_CLOEXEC | SFD_NONBLOCK)) < 0) {
+    perror("Reactor setup");
+    exit(EXIT_FAILURE);
+  }
+  watch(sigfd, event(EV_SIGCHLD, 0, 0));
+
+  // Without it, pipes simply keep their size and no stalls are counted
+  if((samplefd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) >= 0)
+    watch(samplefd, event(EV_SAMPLE, 0, 0));
+  sampling = 0;
+}
+
+static struct input *findInput(int fd) {
+  int i;
+  for(i=0; i<ninputs; i++)
+    if(inputs[i].fd == fd) return &inputs[i];
+  return NULL;
+}
+
+// Watches fd for reading if wanted, and for writing if writable (see watchInput() and watchOutput())
+static void watchFd(int fd, int wanted, int writable) {
+  struct input *in = findInput(fd);
+  struct epoll_event e;
+
+  wanted = wanted != 0;
+  writable = writable != 0;
+  memset(&e, 0, sizeof(e));
+  e.events = (wanted ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0);
+  e.data.u64 = event(EV_INPUT, fd, 0);
+
+  if(in == NULL) {
+    if(ninputs == capinputs) {
+      capinputs = capinputs ? capinputs * 2 : 8;
+      inputs = (struct input*)allocOrDie(realloc(inputs, capinputs * sizeof(struct input)));
+    }
+    in = &inputs[ninputs++];
+    in->fd = fd;
+    in->always = 0;
+    in->writable = 0;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) < 0) {
+      if(errno != EPERM) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+      }
+      in->always = 1;
+    }
+  }
+  else if(!in->always && (wanted != in->wanted || writable != in->writable))
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &e);
+
+  in->wanted = wanted;
+  in->writable = writable && !in->always;
+}
+
+void watchInput(int fd, int wanted) {
+  struct input *in = findInput(fd);
+  watchFd(fd, wanted, in ? in->writable : 0);
+}
+
+void watchOutput(int fd, int writable) {
+  struct input *in = findInput(fd);
+  watchFd(fd, in ? in->wanted : 0, writable);
+}
+
+void unwatchInput(int fd) {
+  struct input *in = findInput(fd);
+
+  if(in == NULL) return;
+  if(!in->always) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+  *in = inputs[--ninputs];
+}
+
+int jobsFull(void) {
+  return njobs - head >= capacity;
+}
+
+int stepJobs(int *ready, int max) {
+  int wanted = 0, always = 0;
+  int i;
+
+  readyinputs = ready;
+  nready = 0;
+  maxready = max;
+
+  // Regular files are never waited for: they are readable right away
+  for(i=0; i<ninputs; i++) {
+    if(inputs[i].writable) wanted = 1;
+    if(!inputs[i].wanted) continue;
+    wanted = 1;
+    if(inputs[i].always) {
+      always = 1;
+      if(nready < maxready) readyinputs[nready++] = inputs[i].fd;
+    }
+  }
+
+  startReady();
+  // Jobs done as they started (copies, cache hits) are flushed without waiting for an event
+  if(always || (head < njobs && nodeOf(head)->state == JOB_DONE)) waitEvents(0);
+  else if(running > 0 || wanted) waitEvents(-1);
+  flushJobs();
+
+  return nready;
+}
+
+void endJobs(void) {
+  while(ninputs > 0) unwatchInput(inputs[0].fd);
+  free(inputs);
+  inputs = NULL;
+  capinputs = 0;
+
+  while(head < njobs) stepJobs(NULL, 0);
+
+  close(sigfd);
+  if(samplefd >= 0) close(samplefd);
+  close(epfd);
+  sigfd = epfd = samplefd = -1;
+  sigprocmask(SIG_SETMASK, &oldsigmask, NULL);
+
+  flushOutput();
+  journalCommit(1);
+  closeOutput();
+}
+
+void runJobs(void) {
+  beginJobs("OUTPUT.txt");
+  endJobs();
+
+  if(sharing)
+    printf("Shared leading stages: %d lines read them from an earlier line, %d process launches saved\n",
+           sharedlines, savedlaunches);
+}
+
+static unsigned long hashStage(char **argv) {
+  unsigned long h = 0;
+  int i;
+
+  for(i=0; argv[i] != NULL; i++)
+    h = h * 31 + hashName(argv[i]);
+  return h;
+}
+
+// Number of leading stages (same argv) the commands a and b have in common
+static int commonStages(struct command *a, struct command *b) {
+  int k, i;
+
+  for(k=0; k<a->nstages && k<b->nstages; k++) {
+    for(i=0; a->stages[k][i] != NULL && b->stages[k][i] != NULL; i++)
+      if(strcmp(a->stages[k][i], b->stages[k][i]) != 0) break;
+    if(a->stages[k][i] != NULL || b->stages[k][i] != NULL) break;
+  }
+  return k;
+}
+
+// Whether job i is a plain pipeline, run once, that may be part of a group
+static int canShare(int i) {
+  struct node *n = nodeOf(i);
+
+  return n->state == JOB_WAITING && n->cmd->nstages > 1 && n->cmd->nbranches == 0 && !n->parallel &&
+         !n->barrier && n->timeout == 0 && !(n->flags & JOB_INTER) && n->outfd < 0;
+}
+
+// Whether every job i depends on comes before job l (nothing between them writes a file i reads)
+static int dependsBefore(int i, int l) {
+  int k;
+
+  for(k=0; k<nodeOf(i)->ndeps; k++)
+    if(nodeOf(i)->deps[k] >= l) return 0;
+  return 1;
+}
+
+void shareJobs(void) {
+  int *table;   // open addressing, keyed by the first stage: latest job that may lead a group
+  int cap = 64;
+  int i, h, l, k, shared;
+  struct command *c, *cmd;
+
+  sharing = 1;
+  while(cap < 2 * njobs) cap *= 2;
+  table = (int*)allocOrDie(malloc(cap * sizeof(int)));
+  for(h=0; h<cap; h++) table[h] = -1;
+
+  // Groups: the first job starting with a stage leads the later ones starting with it too
+  for(i=0; i<njobs; i++) {
+    if(!canShare(i)) continue;
+
+    for(h = hashStage(nodeOf(i)->cmd->stages[0]) & (cap - 1); table[h] >= 0; h = (h + 1) & (cap - 1))
+      if(commonStages(nodeOf(table[h])->cmd, nodeOf(i)->cmd) > 0) break;
+    l = table[h];
+
+    // A file the shared stages read may have changed in between: i leads the next jobs instead
+    if(l < 0 || !dependsBefore(i, l)) {
+      table[h] = i;
+      continue;
+    }
+
+    // Every job of the group keeps at least one stage of its own
+    shared = commonStages(nodeOf(l)->cmd, nodeOf(i)->cmd);
+    if(shared > nodeOf(l)->cmd->nstages - 1) shared = nodeOf(l)->cmd->nstages - 1;
+    if(shared > nodeOf(i)->cmd->nstages - 1) shared = nodeOf(i)->cmd->nstages - 1;
+
+    nodeOf(i)->leader = l;
+    if(nodeOf(l)->sharers == 0 || shared < nodeOf(l)->shared) nodeOf(l)->shared = shared;
+    nodeOf(l)->sharers++;
+  }
+  free(table);
+
+  for(i=0; i<njobs; i++) {
+    cmd = nodeOf(i)->cmd;
+
+    // Leader: "<shared stages> |{ <rest of its line> ; <share file> }"
+    if(nodeOf(i)->sharers > 0) {
+      shared = nodeOf(i)->shared;
+      c = (struct command*)allocOrDie(calloc(3, sizeof(struct command)));
+      c[0].stages = cmd->stages;
+      c[0].nstages = shared;
+      c[0].branches = c + 1;
+      c[0].nbranches = 2;
+      c[1].stages = cmd->stages + shared;
+      c[1].nstages = cmd->nstages - shared;
+      c[1].redirect = cmd->redirect;
+      c[1].redirectfile = cmd->redirectfile;
+      nodeOf(i)->sharedcmd = c;
+    }
+
+    // Others: the rest of their line, once the leader is done
+    else if((l = nodeOf(i)->leader) >= 0) {
+      shared = nodeOf(i)->shared = nodeOf(l)->shared;
+      c = (struct command*)allocOrDie(calloc(1, sizeof(struct command)));
+      c->stages = cmd->stages + shared;
+      c->nstages = cmd->nstages - shared;
+      c->redirect = cmd->redirect;
+      c->redirectfile = cmd->redirectfile;
+      nodeOf(i)->sharedcmd = c;
+
+      k = nodeOf(i)->ndeps;
+      addEdge(l, i);
+      nodeOf(i)->pending += nodeOf(i)->ndeps - k;
+    }
+  }
+}
+
+void groupSections(int maxgroups) {
+  int *starts = NULL;   // first job of every section, then njobs
+  int nstarts = 0, capstarts = 0;
+  int i, k, need = 0;
+
+  for(i=0; i<njobs; i++) {
+    if(i > 0 && nodeOf(i)->section == nodeOf(i - 1)->section) {
+      k = nodeOf(i)->ndeps;
+      addEdge(i - 1, i);
+      nodeOf(i)->pending += nodeOf(i)->ndeps - k;
+    }
+    else pushInt(&starts, &nstarts, &capstarts, i);
+  }
+  pushInt(&starts, &nstarts, &capstarts, njobs);
+
+  // Enough slots for the lines of any maxgroups sections in a row
+  for(i=0; i<nstarts - 1; i++) {
+    k = i + maxgroups < nstarts ? i + maxgroups : nstarts - 1;
+    if(starts[k] - starts[i] > need) need = starts[k] - starts[i];
+  }
+  free(starts);
+
+  if(need > capacity) {
+    slots = (struct slot*)allocOrDie(realloc(slots, need * sizeof(struct slot)));
+    memset(slots + capacity, 0, (need - capacity) * sizeof(struct slot));
+    for(i=capacity; i<need; i++) slots[i].timerfd = -1;
+    capacity = need;
+  }
+}
+
+// Joins the arguments of a job back into one line for printing
+static void printCommand(char **args) {
+  int i;
+  for(i=0; args[i] != NULL; i++)
+    printf("%s%s", i ? " " : "", args[i]);
+}
+
+void printPlan(void) {
+  int *wave = (int*)allocOrDie(calloc(njobs ? njobs : 1, sizeof(int)));
+  int i, k, nwaves = 0, nedges = 0;
+
+  // A job's wave is one more than the latest wave it depends on. Every job
+  // of a wave can run at the same time once the previous waves are finished.
+  for(i=0; i<njobs; i++) {
+    wave[i] = 1;
+    for(k=0; k<nodeOf(i)->ndeps; k++)
+      if(wave[nodeOf(i)->deps[k]] + 1 > wave[i]) wave[i] = wave[nodeOf(i)->deps[k]] + 1;
+    if(wave[i] > nwaves) nwaves = wave[i];
+    nedges += nodeOf(i)->ndeps;
+  }
+
+  printf("Execution plan: %d jobs, %d dependencies, %d waves\n\n", njobs, nedges, nwaves);
+
+  for(i=0; i<njobs; i++) {
+    printf("  job %d (line %d) wave %d", i + 1, nodeOf(i)->lineno, wave[i]);
+    if(nodeOf(i)->label) printf(" [%s]", nodeOf(i)->label);
+    if(nodeOf(i)->timeout > 0) printf(" timeout %gs", nodeOf(i)->timeout / 1000.0);
+    if(nodeOf(i)->leader >= 0) printf(" shares %d stages of job %d", nodeOf(i)->shared, nodeOf(i)->leader + 1);
+    if(nodeOf(i)->ndeps > 0) {
+      printf(" after");
+      for(k=0; k<nodeOf(i)->ndeps; k++)
+        printf("%s %d", k ? "," : "", nodeOf(i)->deps[k] + 1);
+    }
+    printf(": ");
+    printCommand(nodeOf(i)->args);
+    printf("\n");
+  }
+
+  free(wave);
+}
+
+void finishJobs(void) {
+  int i;
+
+  for(i=retired; i<njobs; i++) {
+    freeArgs(nodeOf(i)->merge);
+    free(nodeOf(i)->sharedcmd);
+    if(nodeOf(i)->sharefd >= 0) close(nodeOf(i)->sharefd);
+    free(nodeOf(i)->deps);
+    free(nodeOf(i)->dependents);
+  }
+  free(jobs);
+
+  for(i=0; i<capfiles; i++) {
+    free(files[i].name);
+    free(files[i].readers);
+  }
+  free(files);
+  for(i=0; i<caplabels; i++) free(labels[i].name);
+  free(labels);
+  free(pendinglabel);
+  freeArgs(pendingmerge);
+  free(pendingafter);
+
+  for(i=0; i<capacity; i++) {
+    releaseCapture(&slots[i].capture);
+    arenaFree(&slots[i].arena);
+  }
+  free(slots);
+}
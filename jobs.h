@@ -0,0 +1,160 @@
+/*
+    Dependency-aware parallel execution of the lines of a batch file (-j N).
+
+    Before anything runs, the lines are turned into a dependency graph. A line depends on an
+    earlier line when:
+
+      i)   it reads a file the earlier line writes ('>' or '>>' target), or
+      ii)  it writes a file the earlier line reads or writes, or
+      iii) it is preceded by "%AFTER <label>" and the earlier line by "%LABEL <label>".
+
+    Every argument of a line that is not an operator or the name of a command is taken to be
+    a file that the line reads (e.g. hello.txt in "cat hello.txt > newhello.txt").
+    Lines whose dependencies have finished are started, lowest line first, keeping up to
+    N lines in flight. Dependencies that come from somewhere else (e.g. "ls" listing a file
+    created by an earlier line) are not detected: use %LABEL/%AFTER for those.
+
+    The output each line would have written to OUTPUT.txt is captured while it runs and
+    written to OUTPUT.txt in the original line order, after a "### line <n>: exit <status>"
+    header, so OUTPUT.txt ends up byte-identical to the one produced by a serial run (-j 1).
+
+    HOW IT WORKS:
+
+    1. addJob() takes every parsed line. For each file it names, a hash table keeps the
+       last job that wrote it and the jobs that read it since then, so every edge is found
+       with one lookup per argument.
+    2. runJobs() starts the jobs whose dependencies have finished (at most N running, and no
+       further than N * JOB_WINDOW jobs past the oldest one not flushed). The output of
+       each job goes to a pipe handed to startCommand() (see output.h).
+    3. The executor is a single reactor blocked in epoll_wait() on the output pipes of the
+       running jobs, on a pidfd (pidfd_open()) for every process they started, and on a
+       signalfd for SIGCHLD (only needed for processes no pidfd could be opened for), and
+       while pipelines run, on a timerfd that samples how full their pipes are (see struct edge).
+       Output is read as it arrives, and every child is reaped (wait4()) as soon as its
+       pidfd says it exited, in completion order, and handed to its job (jobReaped()).
+       A job is finished once all its processes are reaped and its output pipe is at EOF;
+       it releases the jobs that depend on it.
+    4. Finished jobs at the head of the batch are flushed: their blocks are written to
+       OUTPUT.txt together with writev() and their resources are released, their node in the
+       graph too. The entries of files and readers left with only finished jobs are dropped as
+       the table grows, so lines added while the batch runs don't make the graph grow.
+
+    With --stream and --serve (see stream.h, server.h), lines keep being added while earlier
+    ones run: the steps below are the same, driven by beginJobs()/stepJobs()/endJobs() instead
+    of runJobs(), and a line added after the lines it depends on are done has nothing to wait for.
+
+    A line with a timeout ("%TIMEOUT <secs>" before it, or --job-timeout) runs in a process
+    group of its own, with all its pipeline stages. A timerfd in the same epoll set expires at
+    its deadline: the whole group gets SIGTERM, then SIGKILL JOB_KILL_GRACE ms later if it is
+    still running, and the header of its block in OUTPUT.txt says it timed out.
+*/
+
+// Number of window slots per running job: finished jobs waiting for a slower, earlier line to be flushed
+#define JOB_WINDOW 4
+
+// ms between the SIGTERM and the SIGKILL sent to a line that timed out
+#define JOB_KILL_GRACE 2000
+
+/*
+    Prepares the scheduler for up to maxjobs lines in flight, each of which may run for at most
+    timeout seconds (0 for no limit) unless a %TIMEOUT says otherwise.
+*/
+void initJobs(int maxjobs, double timeout);
+
+/*
+    Handles a %LABEL, %AFTER, %TIMEOUT, %NOCACHE or %PARALLEL line (given as its tokens), which applies to the next line added.
+    Returns 0 if the line is not one of these directives.
+*/
+int jobDirective(char **args);
+
+/*
+    Adds one line of the batch file to the graph: args are its tokens, cmd the same line
+    compiled with compileCommand(), lineno its line number, section the %BEGIN/%END section
+    it is in (see groupSections()) and flags its JOB_ flags.
+    args and cmd must stay valid until the line is flushed (finishJobs() for printPlan()): the
+    scheduler doesn't use them afterwards.
+*/
+void addJob(char **args, struct command *cmd, int lineno, int section, int flags);
+
+/*
+    The lines added from now on belong to owner (--serve, --stream): their blocks go to outfd
+    instead of OUTPUT.txt (unless it is -1), and once a block is written, flushed(owner, job)
+    is called with the finished job (if flushed isn't NULL; job is NULL for a line --resume
+    skips, flushed as it is added). The owner may release the line's args and cmd then.
+    With a cwd (an absolute path, valid until the lines are flushed), the lines run there
+    instead of in the executor's directory, and their relative file names are joined to it
+    to find their dependencies. A line whose directory can't be entered fails (exit status 1).
+    ownJobs(-1, NULL, NULL, NULL), the default, is OUTPUT.txt again.
+*/
+void ownJobs(int outfd, const char *cwd, void *owner, void (*flushed)(void *owner, struct job *job));
+
+/*
+    --share-prefix: called once every line is added, before they run. Lines whose pipelines start
+    with the same stages (same arguments) make a group: the first of them (the leader) runs these
+    stages once, and the others read their output instead of running them again.
+
+    1. A line joins the group of the latest earlier line starting with the same command, unless
+       it depends on that line or on a line after it: one of the files the shared stages read
+       could have changed in between (a line in between writes it). It then leads the later
+       lines itself. The stages shared are the ones all the lines of the group start with, and
+       every line keeps at least its last stage.
+    2. The leader runs as the fan-out "<shared stages> |{ <rest of its line> ; <share file> }"
+       (see struct command): the share file is a memory file (memfd) that receives a copy of
+       the output of the shared stages, up to SHARE_MAX bytes.
+    3. The other lines of the group depend on the leader: once it is done, each runs the rest of
+       its line with stdin read from the share file (a description of its own, from the start).
+       Their output still goes to their own block in OUTPUT.txt, or to their own target. If the
+       shared stages wrote more than SHARE_MAX bytes, they run their whole line instead.
+
+    Not grouped: fan-outs, %PARALLEL and %TIMEOUT lines (a leader killed half-way would leave the
+    others with part of the output), lines inside #INTERSTART/#INTERSTOP and lines reading
+    OUTPUT.txt. runJobs() prints how many process launches the groups saved: the stages the other
+    lines didn't run, less the fan-out helper of every leader.
+*/
+void shareJobs(void);
+
+/*
+    --sections: called once every line is added, before they run. Every %BEGIN/%END section is a
+    group whose lines run one after the other, in order (each line depends on the line before it
+    in its section, whatever files they name), while the groups run at the same time, up to
+    maxgroups of them (the limit of lines in flight given to initJobs()).
+
+    The dependencies between lines of different sections (files, %AFTER) still hold. The window
+    grows to hold the lines of any maxgroups sections in a row: the blocks of the lines of later
+    sections wait in their captures until the earlier sections are written, so OUTPUT.txt is
+    the same as with one line at a time.
+*/
+void groupSections(int maxgroups);
+
+// Prints the computed plan: dependencies of every line, and the wave it can run in
+void printPlan(void);
+
+// Truncates OUTPUT.txt, runs every added line and waits for all of them, flushing their output to OUTPUT.txt
+void runJobs(void);
+
+/*
+    runJobs() in steps, for lines that are added while earlier ones run (--stream, --serve):
+
+    beginJobs()     truncates output (OUTPUT.txt; NULL for none) and sets the reactor up.
+    watchInput()    makes stepJobs() also wake up when fd is readable (if wanted). Can be
+                    called again to change wanted, until unwatchInput().
+    watchOutput()   the same for fd becoming writable (a connection with output kept for
+                    it, see flushOutputTo()). It is returned in ready as well.
+    stepJobs()      starts the ready jobs, waits for one round of events (unless nothing is
+                    running and no input is wanted) and flushes the finished jobs. Stores up
+                    to max input descriptors that became readable in ready, and returns how many.
+    jobsFull()      says whether as many jobs as the window holds are waiting to be flushed:
+                    more input should not be read until a step flushes some.
+    endJobs()       stops watching every input, runs every job added so far to completion
+                    and closes OUTPUT.txt.
+*/
+void beginJobs(const char *output);
+void watchInput(int fd, int wanted);
+void watchOutput(int fd, int writable);
+void unwatchInput(int fd);
+int stepJobs(int *ready, int max);
+int jobsFull(void);
+void endJobs(void);
+
+// Releases the graph
+void finishJobs(void);
@@ -0,0 +1,192 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// for open() and fstat()
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "output.h"
+#include "journal.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+// One finished line (see journal.h)
+struct record {
+  int32_t index;
+  int32_t lineno;
+  int32_t status;
+  int32_t unused;
+  uint64_t args;
+  int64_t end;
+  uint64_t check;
+};
+
+static int journalfd = -1;
+static struct record *records;  // read back by --resume
+static int nrecords;
+static int ndone;               // lines found done so far by journalDone()
+static int resuming;
+
+static struct record *pending;  // added by journalLine(), not written yet
+static int npending, cappending;
+
+static struct timespec lastsync;
+
+static void *allocOrDie(void *p) {
+  if(!p) {
+    printf("Memory allocation unsuccessful! Exiting...\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static uint64_t hashBytes(uint64_t h, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char*)data;
+  while(len--) {
+    h ^= *p++;
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+static uint64_t hashArgs(char **args) {
+  uint64_t h = FNV_OFFSET;
+  int i;
+
+  for(i=0; args[i] != NULL; i++)
+    h = hashBytes(h, args[i], strlen(args[i]) + 1);
+  return h;
+}
+
+static uint64_t recordCheck(struct record *r) {
+  return hashBytes(FNV_OFFSET, r, offsetof(struct record, check));
+}
+
+// Reads the records of the journal up to the first torn or invalid one
+static void readJournal(void) {
+  struct stat st;
+  ssize_t n;
+  int i;
+
+  if(fstat(journalfd, &st) < 0 || st.st_size < (off_t)sizeof(struct record)) return;
+
+  records = (struct record*)allocOrDie(malloc(st.st_size));
+  n = pread(journalfd, records, st.st_size, 0);
+  if(n < 0) n = 0;
+
+  for(i=0; i < n / (ssize_t)sizeof(struct record); i++)
+    if(records[i].index != i || records[i].check != recordCheck(&records[i])) break;
+  nrecords = i;
+}
+
+void openJournal(const char *path, int resume) {
+  journalfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0644);
+  if(journalfd < 0) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  resuming = resume;
+  if(resume) readJournal();
+  clock_gettime(CLOCK_MONOTONIC, &lastsync);
+}
+
+int journalEnabled(void) {
+  return journalfd >= 0;
+}
+
+int journalDone(int index, int lineno, char **args) {
+  if(index != ndone || index >= nrecords) return 0;
+  if(records[index].lineno != lineno || records[index].args != hashArgs(args)) return 0;
+
+  ndone++;
+  return 1;
+}
+
+off_t journalStart(const char *output) {
+  struct stat st;
+  off_t end = 0;
+
+  if(!resuming) return -1;
+
+  // OUTPUT.txt may not have all of what the records say was written to it (the host crashed before a sync)
+  if(stat(output, &st) < 0) st.st_size = 0;
+  while(ndone > 0 && records[ndone - 1].end > st.st_size) ndone--;
+  if(ndone > 0) end = records[ndone - 1].end;
+
+  if(ftruncate(journalfd, (off_t)ndone * sizeof(struct record)) < 0) perror("Truncating the journal");
+  lseek(journalfd, 0, SEEK_END);
+
+  printf("Resuming: %d lines already done, %s truncated to %lld bytes\n\n", ndone, output, (long long)end);
+
+  free(records);
+  records = NULL;
+  nrecords = 0;
+  return end;
+}
+
+void journalLine(int index, int lineno, char **args, int status, off_t end) {
+  struct record *r;
+
+  if(npending == cappending) {
+    cappending = cappending ? cappending * 2 : 64;
+    pending = (struct record*)allocOrDie(realloc(pending, cappending * sizeof(struct record)));
+  }
+
+  r = &pending[npending++];
+  memset(r, 0, sizeof(*r));
+  r->index = index;
+  r->lineno = lineno;
+  r->status = status;
+  r->args = hashArgs(args);
+  r->end = end;
+  r->check = recordCheck(r);
+}
+
+void journalCommit(int sync) {
+  struct timespec now;
+  char *p = (char*)pending;
+  size_t len = npending * sizeof(struct record);
+  ssize_t n;
+
+  if(journalfd < 0 || (npending == 0 && !sync)) return;
+
+  while(len > 0) {
+    n = write(journalfd, p, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) {
+      perror("Writing the journal");
+      break;
+    }
+    p += n;
+    len -= n;
+  }
+  npending = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if(!sync && (now.tv_sec - lastsync.tv_sec) * 1000 + (now.tv_nsec - lastsync.tv_nsec) / 1000000 < JOURNAL_SYNC_MS) return;
+
+  // OUTPUT.txt first: a record that reaches the disk always describes blocks that did
+  syncOutput();
+  if(fdatasync(journalfd) < 0) perror("fdatasync");
+  lastsync = now;
+}
+
+void closeJournal(void) {
+  if(journalfd < 0) return;
+
+  close(journalfd);
+  journalfd = -1;
+
+  free(pending);
+  pending = NULL;
+  cappending = 0;
+}
@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+    Resume journal (--journal, --resume): which lines of a batch are done, so that a run that
+    died (executor killed, host rebooted) can go on where it stopped instead of from %BEGIN.
+
+    The journal (OUTPUT.journal, next to OUTPUT.txt) is append-only. Once the block of a line
+    is written to OUTPUT.txt, one fixed-size record is appended for it:
+
+      index     its position among the lines of the batch (0 for the first one)
+      lineno    its line number
+      args      hash of its tokens, as parseLine() returns them
+      status    its exit status
+      end       size of OUTPUT.txt once its block is written
+      check     hash of the fields above, so that a record torn by a crash is recognized
+
+    HOW IT WORKS:
+
+    1. Blocks are written in line order, so the records are too: the lines that are done
+       always are the first lines of the batch.
+    2. Records are written with one write() per flush of OUTPUT.txt. Every JOURNAL_SYNC_MS at
+       most, OUTPUT.txt and then the journal are fdatasync()ed: a crash of the executor loses
+       nothing, a crash of the host at most the lines of the last JOURNAL_SYNC_MS.
+    3. With --resume, the records are read back. A line is skipped if it has the record of
+       the same index, with the same line number and token hash (the batch file didn't change
+       up to it), a valid check, and an end no bigger than OUTPUT.txt. The first line that
+       doesn't is where the run starts again: OUTPUT.txt is truncated to the end of the last
+       line skipped, and the records after it are dropped.
+
+    Lines that were running when the executor died are run again: what they did besides
+    writing their block (e.g. appending to a '>>' target) may happen twice.
+*/
+
+// Journal of OUTPUT.txt
+#define JOURNAL_FILE "OUTPUT.journal"
+
+// ms between two fdatasync() calls at most, while lines keep finishing
+#define JOURNAL_SYNC_MS 200
+
+/*
+    Turns the journal on: truncates it, or with resume, reads it back first (see above).
+    Exits on failure.
+*/
+void openJournal(const char *path, int resume);
+
+// Whether openJournal() was called
+int journalEnabled(void);
+
+/*
+    Whether the line at index (called for every line, in order) is done according to the journal
+    read by --resume. Always 0 once a line isn't.
+*/
+int journalDone(int index, int lineno, char **args);
+
+/*
+    Called once the lines are known (every journalDone() call made), before output is opened:
+    drops the records after the last line skipped, and returns the size output must be truncated
+    to, or -1 if the run doesn't resume (output starts empty).
+*/
+off_t journalStart(const char *output);
+
+// Adds the record of a line whose block ends at end in OUTPUT.txt (written by journalCommit())
+void journalLine(int index, int lineno, char **args, int status, off_t end);
+
+/*
+    Appends the records added since the last call, once their blocks are written to the output
+    file, and syncs both if sync is set or if JOURNAL_SYNC_MS have passed since the last sync.
+    Does nothing while the journal is off.
+*/
+void journalCommit(int sync);
+
+// Closes the journal (the scheduler made the last journalCommit() call)
+void closeJournal(void);
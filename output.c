@@ -0,0 +1,399 @@
+#define _GNU_SOURCE   // for pipe2()
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+// for open()
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "output.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static int outputfd = -1;
+static int endfd = -1;        // the output file again, without O_APPEND (outputEnd())
+
+// Blocks waiting for the next writev(). owned[i] is the chunk queue[i] points into (NULL for headers).
+static struct iovec *queue;
+static void **owned;
+static int nqueue, capqueue;
+
+/*
+    What a socket couldn't take yet (flushOutputTo()), one list per socket, in order.
+    The entries keep owning their chunks until they are written.
+*/
+struct pending {
+  int fd;
+  struct iovec *iov;
+  void **owned;
+  int n, cap;
+  size_t bytes;
+  struct pending *next;
+};
+
+static struct pending *pendings;
+
+// Written chunks, ready to be used by the next captures
+static char *pool[CAPTURE_POOL];
+static int npool;
+
+static void *allocOrDie(void *p) {
+  if(!p) {
+    printf("Memory allocation unsuccessful! Exiting...\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static char *newChunk(void) {
+  if(npool > 0) return pool[--npool];
+  return (char*)allocOrDie(malloc(CAPTURE_CHUNK));
+}
+
+static void releaseChunk(char *chunk) {
+  if(chunk == NULL) return;
+  if(npool < CAPTURE_POOL) pool[npool++] = chunk;
+  else free(chunk);
+}
+
+static void enqueue(void *base, size_t len, void *chunk) {
+  if(nqueue == capqueue) {
+    capqueue = capqueue ? capqueue * 2 : 64;
+    queue = (struct iovec*)allocOrDie(realloc(queue, capqueue * sizeof(struct iovec)));
+    owned = (void**)allocOrDie(realloc(owned, capqueue * sizeof(void*)));
+  }
+  owned[nqueue] = chunk;
+  queue[nqueue].iov_base = base;
+  queue[nqueue].iov_len = len;
+  nqueue++;
+}
+
+void openOutput(const char *path, off_t keep) {
+  outputfd = open(path, O_WRONLY | O_CREAT | (keep < 0 ? O_TRUNC : 0) | O_APPEND | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP |S_IWUSR); // user - r and w permissions. 
+  if(outputfd < 0 || (keep >= 0 && ftruncate(outputfd, keep) < 0)) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  endfd = open(path, O_WRONLY | O_CLOEXEC);
+}
+
+off_t outputSize(void) {
+  struct stat st;
+  return fstat(outputfd, &st) == 0 ? st.st_size : 0;
+}
+
+void syncOutput(void) {
+  if(outputfd >= 0 && fdatasync(outputfd) < 0) perror("fdatasync");
+}
+
+void closeOutput(void) {
+  flushOutput();
+  free(queue);
+  free(owned);
+  queue = NULL;
+  owned = NULL;
+  capqueue = 0;
+
+  while(npool > 0) free(pool[--npool]);
+
+  if(outputfd >= 0) close(outputfd);
+  if(endfd >= 0) close(endfd);
+  outputfd = endfd = -1;
+}
+
+int startCapture(struct capture *c) {
+  int pipefd[2];
+
+  // The chunk pointer array is kept from the previous line the capture was used for
+  c->nchunks = 0;
+  c->used = 0;
+  c->fd = -1;
+
+  if(pipe2(pipefd, O_CLOEXEC) < 0) {
+    perror("Pipe error");
+    return -1;
+  }
+
+  // The executor never blocks on one line's output while others are waiting
+  fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+  c->fd = pipefd[0];
+
+  return pipefd[1];
+}
+
+int drainCapture(struct capture *c) {
+  ssize_t n;
+
+  while(c->fd >= 0) {
+    if(c->nchunks == 0 || c->used == CAPTURE_CHUNK) {
+      if(c->nchunks == c->capchunks) {
+        c->capchunks = c->capchunks ? c->capchunks * 2 : 4;
+        c->chunks = (char**)allocOrDie(realloc(c->chunks, c->capchunks * sizeof(char*)));
+      }
+      c->chunks[c->nchunks++] = newChunk();
+      c->used = 0;
+    }
+
+    n = read(c->fd, c->chunks[c->nchunks - 1] + c->used, CAPTURE_CHUNK - c->used);
+    if(n > 0) {
+      c->used += n;
+      continue;
+    }
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && errno == EAGAIN) return 0;
+
+    // EOF (or an error, which ends the capture the same way)
+    close(c->fd);
+    c->fd = -1;
+  }
+
+  return 1;
+}
+
+size_t captureSize(struct capture *c) {
+  return c->nchunks == 0 ? 0 : (size_t)(c->nchunks - 1) * CAPTURE_CHUNK + c->used;
+}
+
+int saveCapture(struct capture *c, int fd) {
+  size_t len;
+  ssize_t n;
+  char *p;
+  int i;
+
+  for(i=0; i<c->nchunks; i++) {
+    p = c->chunks[i];
+    for(len = i == c->nchunks - 1 ? c->used : CAPTURE_CHUNK; len > 0; p += n, len -= n) {
+      n = write(fd, p, len);
+      if(n < 0 && errno == EINTR) n = 0;
+      else if(n < 0) return -1;
+    }
+  }
+  return 0;
+}
+
+size_t queueBlock(struct capture *c, int lineno, int status, int timedout) {
+  size_t size = captureSize(c);
+  int len, i;
+
+  if(WIFSIGNALED(status))
+    len = snprintf(c->header, sizeof(c->header), "### line %d: killed by signal %d", lineno, WTERMSIG(status));
+  else
+    len = snprintf(c->header, sizeof(c->header), "### line %d: exit %d", lineno, WEXITSTATUS(status));
+
+  if(timedout)
+    len += snprintf(c->header + len, sizeof(c->header) - len, " (timed out after %gs)", timedout / 1000.0);
+
+  len += snprintf(c->header + len, sizeof(c->header) - len, "\n");
+
+  enqueue(c->header, len, NULL);
+
+  for(i=0; i<c->nchunks; i++)
+    enqueue(c->chunks[i], i == c->nchunks - 1 ? c->used : CAPTURE_CHUNK, c->chunks[i]);
+
+  c->nchunks = 0;
+  return len + size;
+}
+
+void releaseCapture(struct capture *c) {
+  free(c->chunks);
+  c->chunks = NULL;
+  c->capchunks = 0;
+}
+
+/*
+    Writes the n entries of iov (owning the chunks in owned) to fd, a socket if sock, and releases
+    the chunks written. Returns how many entries were written completely; a short write leaves the
+    rest of an entry in iov. A socket that can't take more (EAGAIN) stops early, any other error
+    sets *failed.
+*/
+static int writeEntries(int fd, int sock, struct iovec *iov, void **own, int n, int *failed) {
+  struct msghdr msg;
+  int done = 0;     // entries completely written
+  int count;
+  ssize_t w;
+
+  *failed = 0;
+  while(done < n) {
+    count = n - done < IOV_MAX ? n - done : IOV_MAX;
+    if(sock) {
+      // MSG_NOSIGNAL: a client that went away is an error, not a SIGPIPE
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov + done;
+      msg.msg_iovlen = count;
+      w = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    else w = writev(fd, iov + done, count);
+    if(w < 0) {
+      if(errno == EINTR) continue;
+      if(sock && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      *failed = 1;
+      break;
+    }
+
+    // Skip what was written; a short write leaves the rest of an entry for the next call
+    while(done < n && w >= (ssize_t)iov[done].iov_len) {
+      w -= iov[done].iov_len;
+      releaseChunk(own[done]);
+      done++;
+    }
+    if(w > 0) {
+      iov[done].iov_base = (char*)iov[done].iov_base + w;
+      iov[done].iov_len -= w;
+    }
+  }
+
+  return done;
+}
+
+void flushOutput(void) {
+  int failed, done, i;
+
+  done = outputfd >= 0 ? writeEntries(outputfd, 0, queue, owned, nqueue, &failed) : 0;
+  if(outputfd >= 0 && failed) perror("OUTPUT.txt");
+
+  // Whatever couldn't be written (after an error) is dropped
+  for(i=done; i<nqueue; i++) releaseChunk(owned[i]);
+  nqueue = 0;
+}
+
+static struct pending *findPending(int fd) {
+  struct pending *p;
+  for(p = pendings; p; p = p->next)
+    if(p->fd == fd) return p;
+  return NULL;
+}
+
+// Releases the chunks of what is pending for p->fd from entry first on, and p itself
+static void dropPending(struct pending *p, int first) {
+  struct pending **q;
+  int i;
+
+  for(i=first; i<p->n; i++) releaseChunk(p->owned[i]);
+  for(q = &pendings; *q != p; q = &(*q)->next)
+    ;
+  *q = p->next;
+  free(p->iov);
+  free(p->owned);
+  free(p);
+}
+
+void flushOutputTo(int fd) {
+  struct pending *p = findPending(fd);
+  int failed, done, i;
+
+  if(p == NULL && nqueue == 0) return;
+  if(p == NULL) {
+    p = (struct pending*)allocOrDie(calloc(1, sizeof(struct pending)));
+    p->fd = fd;
+    p->next = pendings;
+    pendings = p;
+  }
+
+  // The queued blocks go after what is already waiting for the socket
+  if(p->n + nqueue > p->cap) {
+    while(p->n + nqueue > p->cap) p->cap = p->cap ? p->cap * 2 : 64;
+    p->iov = (struct iovec*)allocOrDie(realloc(p->iov, p->cap * sizeof(struct iovec)));
+    p->owned = (void**)allocOrDie(realloc(p->owned, p->cap * sizeof(void*)));
+  }
+  for(i=0; i<nqueue; i++) {
+    p->iov[p->n] = queue[i];
+    p->owned[p->n] = owned[i];
+    p->n++;
+  }
+  nqueue = 0;
+
+  done = writeEntries(fd, 1, p->iov, p->owned, p->n, &failed);
+
+  // A client that went away gets nothing more
+  if(failed || done == p->n) {
+    dropPending(p, done);
+    return;
+  }
+
+  memmove(p->iov, p->iov + done, (p->n - done) * sizeof(struct iovec));
+  memmove(p->owned, p->owned + done, (p->n - done) * sizeof(void*));
+  p->n -= done;
+  for(p->bytes = 0, i = 0; i < p->n; i++) p->bytes += p->iov[i].iov_len;
+}
+
+size_t pendingOutput(int fd) {
+  struct pending *p = findPending(fd);
+  return p ? p->bytes : 0;
+}
+
+void dropOutput(int fd) {
+  struct pending *p = findPending(fd);
+  if(p) dropPending(p, 0);
+}
+
+void queueText(const char *text, size_t len) {
+  char *chunk;
+  size_t n;
+
+  for(; len > 0; text += n, len -= n) {
+    n = len < CAPTURE_CHUNK ? len : CAPTURE_CHUNK;
+    chunk = newChunk();
+    memcpy(chunk, text, n);
+    enqueue(chunk, n, chunk);
+  }
+}
+
+int outputEnd(off_t *off) {
+  struct stat st;
+
+  if(endfd < 0 || fstat(endfd, &st) < 0) {
+    *off = -1;
+    return outputfd;
+  }
+  *off = st.st_size;
+  return endfd;
+}
+
+ssize_t copyData(int in, int out, off_t *off) {
+  char buf[CAPTURE_CHUNK];
+  ssize_t n, w, total = 0;
+  char *p;
+
+  if(off != NULL && *off < 0) off = NULL;
+
+  // File to file, without the data leaving the kernel (or even being copied, on filesystems that share extents)
+  while((n = copy_file_range(in, NULL, out, off, COPY_CHUNK, 0)) > 0) total += n;
+  if(n == 0) return total;
+  if(errno != EXDEV && errno != EINVAL && errno != EBADF && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+
+  // To a socket or pipe (or a file copy_file_range() can't write)
+  if(off == NULL) {
+    while((n = sendfile(out, in, NULL, COPY_CHUNK)) > 0) total += n;
+    if(n == 0) return total;
+    if(errno != EINVAL && errno != ENOSYS) return -1;
+  }
+
+  while((n = read(in, buf, sizeof(buf))) != 0) {
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    for(p = buf; n > 0; p += w, n -= w, total += w) {
+      w = off != NULL ? pwrite(out, p, n, *off) : write(out, p, n);
+      if(w < 0) {
+        if(errno == EINTR) { w = 0; continue; }
+        return -1;
+      }
+      if(off != NULL) *off += w;
+    }
+  }
+
+  return total;
+}
@@ -0,0 +1,115 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+    Single writer of OUTPUT.txt.
+
+    The executor opens OUTPUT.txt once. The output of every line reaches it through a pipe:
+    the write end is the line's output (struct job's outfd) and the read end is drained by
+    the executor into a list of chunks while the line runs. Once the line has finished, its
+    block (a header with the line number and exit status, followed by the chunks) is queued,
+    and the queued blocks of consecutive lines are written with one writev().
+
+    Nothing but the executor writes OUTPUT.txt, so blocks of lines that run at the same time
+    can't interleave, and no line pays for opening the file.
+
+    The lines submitted to a server (--serve) have their blocks written the same way, to the
+    connection of the client that submitted them instead of OUTPUT.txt (flushOutputTo()).
+    A connection is never waited for: what it can't take yet is kept for it until it can.
+*/
+
+// Size of the chunks the output of a line is read into
+#define CAPTURE_CHUNK 65536
+
+// Chunks kept for reuse once written, instead of being freed
+#define CAPTURE_POOL 256
+
+/*
+    Output of one line, read from its pipe.
+    A capture can be reused for another line once its block has been written (flushOutput()).
+*/
+struct capture {
+    int fd;             // read end of the pipe (non-blocking), -1 once EOF was seen
+    char **chunks;      // CAPTURE_CHUNK bytes each
+    int nchunks, capchunks;
+    size_t used;        // bytes used in the last chunk
+    char header[96];    // header of the block, queued with it
+};
+
+// Opens the output file, truncated to keep bytes (emptied if keep is -1, see journal.h). Exits on failure.
+void openOutput(const char *path, off_t keep);
+
+// Size of the output file, with everything flushed so far
+off_t outputSize(void);
+
+// Makes what was written to the output file durable (fdatasync())
+void syncOutput(void);
+
+// Writes what is still queued, closes the output file and releases the pooled chunks
+void closeOutput(void);
+
+/*
+    Creates the pipe of a capture. Returns the write end, to be used as the line's output
+    (and closed by the caller once the line's processes are started), or -1 on failure.
+*/
+int startCapture(struct capture *c);
+
+// Reads whatever is available on the pipe. Returns 1 once the pipe has reached EOF.
+int drainCapture(struct capture *c);
+
+// Number of bytes captured so far (until the capture is queued)
+size_t captureSize(struct capture *c);
+
+// Writes what was captured so far to fd (a result cache entry, see cache.h). Returns -1 on errors.
+int saveCapture(struct capture *c, int fd);
+
+/*
+    Queues the block of a finished line: the header, then the captured output.
+    timedout is the timeout (ms) the line was killed after, noted in the header (0 if none).
+    The chunks of the capture are owned by the queue from now on, and go back to
+    the pool once written. The capture itself must stay untouched until then.
+    Returns the size of the block.
+*/
+size_t queueBlock(struct capture *c, int lineno, int status, int timedout);
+
+// Writes every queued block with as few writev() calls as possible
+void flushOutput(void);
+
+/*
+    Writes every queued block to the socket fd instead (--serve, see server.h), without waiting
+    for it: what the socket can't take now is kept, after what was already kept for it, and
+    written by the next flushOutputTo(fd) (once fd is writable). Nothing is kept for a socket
+    that fails (the client went away).
+*/
+void flushOutputTo(int fd);
+
+// Bytes kept for the socket fd by flushOutputTo(), not written yet
+size_t pendingOutput(int fd);
+
+// Drops what is kept for the socket fd (before it is closed)
+void dropOutput(int fd);
+
+// Queues a copy of text, written with the next blocks (messages of the server to a client)
+void queueText(const char *text, size_t len);
+
+// Bytes moved per copy_file_range() or sendfile() call by copyData()
+#define COPY_CHUNK (1 << 30)
+
+/*
+    Copies what is left of the file in to out without reading it into the executor when the
+    kernel can: copy_file_range() from file to file (written at *off when off isn't NULL, which
+    is then moved forward), else sendfile() (to a socket or a pipe), else read() and write().
+    Returns the number of bytes copied, or -1 (with errno set) on errors.
+*/
+ssize_t copyData(int in, int out, off_t *off);
+
+/*
+    Returns a descriptor of the output file that can be written at *off, set to its current end.
+    Unlike the descriptor the blocks are written through, it isn't O_APPEND, which copy_file_range()
+    refuses. Only for a line whose block is the next one to be written (nothing is queued).
+    Sets *off to -1 if the output file can only be appended to.
+*/
+int outputEnd(off_t *off);
+
+// Releases the chunk pointer array of a capture that won't be reused
+void releaseCapture(struct capture *c);
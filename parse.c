@@ -2,54 +2,202 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+
+// for open(), fstat() and mmap()
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 #include "parse.h"
 
-char** parseLine(char *line) {
-    int len = strlen(line);
-    int argsize = tok_size;
-    char** args = (char**)malloc(argsize * sizeof(char*));
-    int pos = 0;
+#define isDelimiter(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
 
-    char* arg;
+int tokenizeLine(char *line, char *end, char **args, int max) {
+  char *p = line;
+  int pos = 0;
 
-    if(!args) {
-        // Not enough space available. Return failure and exit.
-        printf("Memory allocation unsuccessful! Exiting...\n");
-        exit(EXIT_FAILURE);     
-    }
+  while(pos < max) {
+    while(p < end && *p != '\0' && isDelimiter(*p)) p++;
+    if(p == end || *p == '\0') break;
 
+    // Don't parse after the beginning of a commment is detected
+    if(p[0] == '#' && (p + 1 == end || p[1] == '\0' || isDelimiter(p[1]))) break;
 
-    // Key parsing logic:
-    // Get the first argument. 
-    // While the argument is valid (i.e., not null), add it to the list of arguments that will be returned to the main function.
-    // Take care of running out of space using realloc.
-    arg = strtok(line, tok_delimiters);
-    
-    while(arg != NULL) {
+    args[pos++] = p;
+    while(p < end && *p != '\0' && !isDelimiter(*p)) p++;
+    if(p < end) *p++ = '\0';
+  }
 
-        if(strcmp(arg, "#") == 0) break;    // Don't parse after the beginning of a commment is detected
-        
-        args[pos] = arg;
-        pos = pos + 1;
+  args[pos] = NULL;
+  return pos;
+}
 
-        if(pos > argsize) {
-            // reallocate memory for args
-            argsize = argsize + tok_size;
-            args = realloc(args, argsize*sizeof(char*));
+// Number of tokens tokenizeLine() would find in [line, end)
+static int countTokens(const char *line, const char *end) {
+  const char *p = line;
+  int n = 0;
 
-            if(!args) {
-               // Not enough space available. Return failure and exit.
-                printf("Memory allocation unsuccessful! Exiting...\n");
-                exit(EXIT_FAILURE);     
-            }
+  for(;;) {
+    while(p < end && isDelimiter(*p)) p++;
+    if(p == end) break;
+    if(p[0] == '#' && (p + 1 == end || isDelimiter(p[1]))) break;
+    n++;
+    while(p < end && !isDelimiter(*p)) p++;
+  }
+
+  return n;
+}
+
+char** parseLine(char *line, struct arena *a) {
+  char *end = line + strlen(line);
+  int n = countTokens(line, end);
+  char **args = (char**)arenaAlloc(a, (n + 1) * sizeof(char*));
+
+  tokenizeLine(line, end, args, n);
+
+  return args;
+}
 
-        }
+// A part of the mapped file, parsed by one thread
+struct chunk {
+  char *start, *end;        // starts at the beginning of a line, ends after a newline (or at EOF)
+  struct arena *arena;
+  struct batchline *lines;
+  int nlines;
+};
+
+static void *parseChunk(void *arg) {
+  struct chunk *c = (struct chunk*)arg;
+  char *p, *eol, *next;
+  struct batchline *l;
+  size_t len;
+  int n;
+
+  // Count the lines first, so that they are allocated at once
+  c->nlines = 0;
+  for(p = c->start; p < c->end; p = eol + 1) {
+    eol = memchr(p, '\n', c->end - p);
+    c->nlines++;
+    if(eol == NULL) break;
+  }
+
+  c->lines = (struct batchline*)arenaAlloc(c->arena, (c->nlines ? c->nlines : 1) * sizeof(struct batchline));
+
+  for(p = c->start, l = c->lines; p < c->end; p = next, l++) {
+    eol = memchr(p, '\n', c->end - p);
+    next = eol ? eol + 1 : c->end;
+    len = eol ? (size_t)(eol - p) : (size_t)(c->end - p);
+
+    l->lineno = l - c->lines + 1;     // made absolute once every chunk is done
+    l->text = p;
+    l->len = len;
+
+    // Lines with tokens are copied (NUL-terminated) and split in the copy: the
+    // mapped file is only read. Blank and comment lines stay where they are.
+    n = countTokens(p, p + len);
+    l->args = (char**)arenaAlloc(c->arena, (n + 1) * sizeof(char*));
+    if(n > 0) l->text = arenaStrndup(c->arena, p, len);
+    l->nargs = tokenizeLine(l->text, l->text + len, l->args, n);
+  }
+
+  return NULL;
+}
 
-        arg = strtok(NULL, tok_delimiters);
+int loadBatch(const char *path, struct batch *b, int nthreads) {
+  struct stat st;
+  struct chunk *chunks;
+  pthread_t *threads;
+  char *p, *end;
+  int fd, i, k, base;
+
+  memset(b, 0, sizeof(*b));
+
+  if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+  if(fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  b->size = st.st_size;
+  if(b->size > 0) {
+    b->data = (char*)mmap(NULL, b->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(b->data == MAP_FAILED) {
+      b->data = NULL;
+      close(fd);
+      return -1;
+    }
+    madvise(b->data, b->size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  if(nthreads > (int)(b->size / PARSE_CHUNK_MIN)) nthreads = b->size / PARSE_CHUNK_MIN;
+  if(nthreads < 1) nthreads = 1;
+
+  chunks = (struct chunk*)calloc(nthreads, sizeof(struct chunk));
+  threads = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+  b->arenas = (struct arena*)calloc(nthreads, sizeof(struct arena));
+  if(!chunks || !threads || !b->arenas) {
+    printf("Memory allocation unsuccessful! Exiting...\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Cut the file into nthreads parts of about the same size, each one ending after a newline
+  p = b->data;
+  end = b->data + b->size;
+  for(i=0; i<nthreads; i++) {
+    chunks[i].start = p;
+    chunks[i].arena = &b->arenas[i];
+    if(i == nthreads - 1)
+      p = end;
+    else {
+      p = b->data + b->size / nthreads * (i + 1);
+      if(p < chunks[i].start) p = chunks[i].start;
+      p = memchr(p, '\n', end - p);
+      p = p ? p + 1 : end;
+    }
+    chunks[i].end = p;
+  }
+  b->nchunks = nthreads;
+
+  for(i=1; i<nthreads; i++) {
+    if(pthread_create(&threads[i], NULL, parseChunk, &chunks[i]) != 0)
+      threads[i] = 0;
+  }
+  parseChunk(&chunks[0]);
+  for(i=1; i<nthreads; i++) {
+    if(threads[i]) pthread_join(threads[i], NULL);
+    else parseChunk(&chunks[i]);    // couldn't start a thread for it
+  }
+
+  // Put the lines of all chunks together, with their line numbers made absolute
+  for(i=0; i<nthreads; i++) b->nlines += chunks[i].nlines;
+  b->lines = (struct batchline*)arenaAlloc(&b->arenas[0], (b->nlines ? b->nlines : 1) * sizeof(struct batchline));
+
+  for(i=0, base=0; i<nthreads; i++) {
+    for(k=0; k<chunks[i].nlines; k++) {
+      b->lines[base + k] = chunks[i].lines[k];
+      b->lines[base + k].lineno += base;
     }
-    
-    args[pos] = NULL;
+    base += chunks[i].nlines;
+  }
+
+  free(chunks);
+  free(threads);
+  return 0;
+}
+
+int lineIs(struct batchline *l, const char *word) {
+  // The only token starts the line, and the line is as long as the token
+  return l->nargs == 1 && l->args[0] == l->text && strcmp(l->args[0], word) == 0 && l->len == (int)strlen(word);
+}
+
+void unloadBatch(struct batch *b) {
+  int i;
 
-    return args;
+  for(i=0; i<b->nchunks; i++) arenaFree(&b->arenas[i]);
+  free(b->arenas);
+  if(b->data) munmap(b->data, b->size);
+  memset(b, 0, sizeof(*b));
 }
@@ -1,7 +1,67 @@
+#include "arena.h"
+
 #define tok_delimiters " \t\n\r"
-#define tok_size 128
 
 /*
     Function to parse a space separated line containing a command and its corresponding args.
+    The line is split in place; the returned array is allocated from arena a.
+*/
+char** parseLine(char *line, struct arena *a);
+
+/*
+    Splits line into tokens in place: every token is NUL-terminated where its delimiter was and
+    stored in args (at most max of them, followed by NULL). Parsing stops at the end of the line
+    or at a comment ('#' on its own). Returns the number of tokens.
+    Unlike strtok(), keeps no state between calls, so several threads can use it at once.
+*/
+int tokenizeLine(char *line, char *end, char **args, int max);
+
+/*
+    One line of a batch file loaded with loadBatch().
+
+    lineno  :   line number in the batch file (from 1)
+    text    :   the line: a NUL-terminated copy in the arena if it has tokens, or else
+                its start in the mapped file (not NUL-terminated)
+    len     :   length of the line, without the newline
+    nargs   :   number of tokens
+    args    :   tokens (slices of the copy, NUL-terminated in place), followed by NULL
+*/
+struct batchline {
+    int lineno;
+    char *text;
+    int len;
+    int nargs;
+    char **args;
+};
+
+/*
+    A batch file loaded in memory.
+
+    The file is mapped read-only with mmap() and split into chunks at line boundaries. Every
+    chunk is parsed by its own thread into its own arena, which gets a copy of each line with
+    tokens (split in place there): the pages of the mapping are only read, never copied on
+    write, and there is no allocation per line, only per arena block.
 */
-char** parseLine(char *line);
\ No newline at end of file
+struct batch {
+    char *data;                 // the mapped file
+    size_t size;
+    struct batchline *lines;    // every line, in order
+    int nlines;
+    struct arena *arenas;       // one per chunk
+    int nchunks;
+};
+
+// Files smaller than this per thread are not worth splitting
+#define PARSE_CHUNK_MIN (1 << 20)
+
+/*
+    Maps and parses the batch file at path, with up to nthreads threads.
+    Returns 0, or -1 (with errno set) if the file can't be read.
+*/
+int loadBatch(const char *path, struct batch *b, int nthreads);
+
+// Checks whether a loaded line consists of exactly the given word, with nothing around it
+int lineIs(struct batchline *l, const char *word);
+
+// Releases everything loadBatch() allocated and unmaps the file
+void unloadBatch(struct batch *b);
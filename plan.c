@@ -0,0 +1,444 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+
+// for open(), stat() and mmap()
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "parse.h"
+#include "execute.h"
+#include "plan.h"
+
+#define PLAN_MAGIC "BJEPLAN"
+#define PLAN_VERSION 4
+
+// Start of a plan file. The entries follow it.
+struct planheader {
+  char magic[8];          // PLAN_MAGIC
+  uint32_t version;       // PLAN_VERSION
+  uint32_t layout;        // sizes of a pointer and of an entry: a plan of another build isn't used
+  uint64_t hash;          // FNV-1a of the batch file
+  uint64_t size;          // size, modification time and inode of the batch file
+  int64_t mtime, mtimensec;
+  uint64_t ino;
+  uint32_t nentries;
+  int32_t unterminated;
+  uint64_t total;         // size of the plan file
+};
+
+#define PLAN_LAYOUT ((uint32_t)(sizeof(void*) << 16 | sizeof(struct planentry)))
+
+// Hashes len bytes with 64 bit FNV-1a
+static uint64_t hashBytes(const char *data, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for(i=0; i<len; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 1099511628211ULL;
+  }
+
+  return h;
+}
+
+// Hashes the content of the file at path. Returns 0, or -1 if it can't be read.
+static int hashFile(const char *path, uint64_t *hash) {
+  struct stat st;
+  char *data;
+  int fd;
+
+  if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+  if(fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  if(st.st_size == 0) {
+    close(fd);
+    *hash = hashBytes(NULL, 0);
+    return 0;
+  }
+
+  data = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) return -1;
+
+  *hash = hashBytes(data, st.st_size);
+  munmap(data, st.st_size);
+  return 0;
+}
+
+// Whether the batch file still has the size, time and inode recorded in the header
+static int sameFile(struct planheader *h, struct stat *st) {
+  return h->size == (uint64_t)st->st_size && h->mtime == (int64_t)st->st_mtim.tv_sec &&
+         h->mtimensec == (int64_t)st->st_mtim.tv_nsec && h->ino == (uint64_t)st->st_ino;
+}
+
+int planLine(struct sections *st, struct batchline *l, struct planentry *e, struct arena *a) {
+  if(lineIs(l, "%BEGIN")) {
+    if(!st->begin) st->count++;
+    st->begin = 1;    // seen begin (other begins are ignored). Now, we can start processing from the next line.
+    return 0;
+  }
+
+  if(st->begin == 0) return 0;
+
+  if(lineIs(l, "%END")) {
+    st->begin = 0;
+    return 0;
+  }
+
+  if(strncmp(l->text, "#INTERSTART", 11) == 0) { st->flags |= JOB_INTER; return 0; }
+  if(strncmp(l->text, "#INTERSTOP", 10) == 0) { st->flags &= ~JOB_INTER; return 0; }
+
+  // Blank lines and comments have no tokens: nothing to run
+  if(l->args[0] == NULL) return 0;
+
+  memset(e, 0, sizeof(*e));
+  e->lineno = l->lineno;
+  e->section = st->count - 1;
+  e->args = l->args;
+
+  if(l->text[0] == '%') {
+    e->kind = PLAN_DIRECTIVE;
+    return 1;
+  }
+
+  e->kind = PLAN_JOB;
+  e->flags = st->flags;
+  compileCommand(l->args, &e->command, a);
+  return 1;
+}
+
+// Goes through the lines of the loaded batch file, keeping those that make an entry
+static void compilePlan(struct plan *p) {
+  struct batch *b = &p->batch;
+  struct sections st = { 0, 0, 0 };
+  int i;
+
+  p->entries = (struct planentry*)arenaAlloc(&p->arena, (b->nlines ? b->nlines : 1) * sizeof(struct planentry));
+
+  for(i=0; i<b->nlines; i++)
+    if(planLine(&st, &b->lines[i], &p->entries[p->nentries], &p->arena)) p->nentries++;
+
+  p->unterminated = st.begin;
+}
+
+// The plan file being written: every pointer in it is an offset from data
+struct planbuf {
+  char *data;
+  size_t len, cap;
+};
+
+// Appends size bytes (aligned to align) and returns their offset
+static size_t put(struct planbuf *pb, const void *data, size_t size, size_t align) {
+  size_t off = (pb->len + align - 1) & ~(align - 1);
+
+  if(off + size > pb->cap) {
+    while(off + size > pb->cap) pb->cap = pb->cap ? pb->cap * 2 : 65536;
+    pb->data = (char*)realloc(pb->data, pb->cap);
+    if(!pb->data) {
+      printf("Memory allocation unsuccessful! Exiting...\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  memset(pb->data + pb->len, 0, off - pb->len);
+  if(data) memcpy(pb->data + off, data, size);
+  else memset(pb->data + off, 0, size);
+  pb->len = off + size;
+  return off;
+}
+
+#define asOffset(off) ((void*)(uintptr_t)(off))
+
+// Offset of the string s, one of the args written at argoffs (written again if it isn't one of them)
+static size_t stringOffset(struct planbuf *pb, char **args, size_t *argoffs, char *s) {
+  int i;
+
+  for(i=0; args[i] != NULL; i++)
+    if(args[i] == s) return argoffs[i];
+
+  return put(pb, s, strlen(s) + 1, 1);
+}
+
+// Writes an argv array whose strings are among args, and returns its offset
+static size_t putArgv(struct planbuf *pb, char **args, size_t *argoffs, char **argv) {
+  size_t off;
+  int n = argsLength(argv);
+  int i;
+  void *slot;
+
+  off = put(pb, NULL, (n + 1) * sizeof(char*), sizeof(char*));
+  for(i=0; i<n; i++) {
+    slot = asOffset(stringOffset(pb, args, argoffs, argv[i]));
+    memcpy(pb->data + off + i * sizeof(char*), &slot, sizeof(slot));
+  }
+
+  return off;
+}
+
+/*
+    Writes the arrays and strings of the compiled line c (whose tokens are args, written at argoffs)
+    and its fan-out consumers, and turns the pointers of c into their offsets.
+*/
+static void putCommand(struct planbuf *pb, char **args, size_t *argoffs, struct command *c) {
+  struct command b;
+  size_t off;
+  void *slot;
+  int k;
+
+  off = put(pb, NULL, c->nstages * sizeof(char**), sizeof(char**));
+  for(k=0; k<c->nstages; k++) {
+    slot = asOffset(putArgv(pb, args, argoffs, c->stages[k]));
+    memcpy(pb->data + off + k * sizeof(char**), &slot, sizeof(slot));
+  }
+  c->stages = (char***)asOffset(off);
+
+  if(c->redirectfile)
+    c->redirectfile = (char*)asOffset(stringOffset(pb, args, argoffs, c->redirectfile));
+
+  if(c->nbranches > 0) {
+    off = put(pb, NULL, c->nbranches * sizeof(struct command), 8);
+    for(k=0; k<c->nbranches; k++) {
+      b = c->branches[k];
+      putCommand(pb, args, argoffs, &b);
+      memcpy(pb->data + off + k * sizeof(struct command), &b, sizeof(b));
+    }
+    c->branches = (struct command*)asOffset(off);
+  }
+}
+
+/*
+    Writes the plan to path (through a temporary file renamed over it, so that a concurrent
+    run never maps a half written plan). Failing to write it is not an error: it's only a cache.
+*/
+static void savePlan(const char *path, struct plan *p, struct stat *st, uint64_t hash) {
+  struct planbuf pb = { NULL, 0, 0 };
+  struct planheader h;
+  struct planentry e;
+  size_t entriesoff, off;
+  size_t *argoffs;
+  char tmp[PATH_MAX + 16];   // path, '.' and the pid
+  int i, k, n, fd;
+  ssize_t w;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, PLAN_MAGIC, sizeof(PLAN_MAGIC));
+  h.version = PLAN_VERSION;
+  h.layout = PLAN_LAYOUT;
+  h.hash = hash;
+  h.size = st->st_size;
+  h.mtime = st->st_mtim.tv_sec;
+  h.mtimensec = st->st_mtim.tv_nsec;
+  h.ino = st->st_ino;
+  h.nentries = p->nentries;
+  h.unterminated = p->unterminated;
+
+  put(&pb, &h, sizeof(h), 8);
+  entriesoff = put(&pb, NULL, p->nentries * sizeof(struct planentry), 8);
+
+  for(i=0; i<p->nentries; i++) {
+    e = p->entries[i];
+
+    // The strings of the line first, then the arrays pointing to them
+    n = argsLength(e.args);
+    argoffs = (size_t*)malloc((n + 1) * sizeof(size_t));
+    if(!argoffs) {
+      printf("Memory allocation unsuccessful! Exiting...\n");
+      exit(EXIT_FAILURE);
+    }
+    for(k=0; k<n; k++)
+      argoffs[k] = put(&pb, e.args[k], strlen(e.args[k]) + 1, 1);
+
+    e.args = (char**)asOffset(putArgv(&pb, p->entries[i].args, argoffs, p->entries[i].args));
+
+    if(e.kind == PLAN_JOB)
+      putCommand(&pb, p->entries[i].args, argoffs, &e.command);
+
+    free(argoffs);
+    memcpy(pb.data + entriesoff + i * sizeof(struct planentry), &e, sizeof(e));
+  }
+
+  // Every string in the file is NUL-terminated, even in a corrupt one
+  put(&pb, "", 1, 1);
+
+  h.total = pb.len;
+  memcpy(pb.data, &h, sizeof(h));
+
+  // A name cut short could be another file: no plan is written then
+  if(snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >= (int)sizeof(tmp)) {
+    free(pb.data);
+    return;
+  }
+
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
+  if(fd >= 0) {
+    for(off=0; off<pb.len; off+=w) {
+      w = write(fd, pb.data + off, pb.len - off);
+      if(w < 0 && errno == EINTR) w = 0;
+      else if(w <= 0) break;
+    }
+    close(fd);
+
+    if(off == pb.len && rename(tmp, path) == 0) tmp[0] = '\0';
+    if(tmp[0] != '\0') unlink(tmp);
+  }
+
+  free(pb.data);
+}
+
+// Turns the offset in pointer p into a pointer into the map (of total bytes). Returns 0 if it is out of it.
+#define relocate(p) ((p) == NULL || ((uintptr_t)(p) < total && ((p) = (void*)(map + (uintptr_t)(p)), 1)))
+
+// Relocates a NULL-terminated argv array of the map and the strings it points to
+static int relocateArgv(char *map, size_t total, char ***argv) {
+  char **a;
+  size_t k;
+
+  if(*argv == NULL || !relocate(*argv)) return 0;
+
+  for(a = *argv, k = 0; (char*)(a + k + 1) <= map + total; k++) {
+    if(a[k] == NULL) return 1;
+    if(!relocate(a[k])) return 0;
+  }
+
+  return 0;   // runs past the end of the map
+}
+
+// Relocates a compiled line of the map, and its fan-out consumers (nested no deeper than a corrupt plan could loop)
+static int relocateCommand(char *map, size_t total, struct command *c, int depth) {
+  int k;
+
+  if(c->nstages < 1 || c->stages == NULL || !relocate(c->stages)) return 0;
+  if((char*)(c->stages + c->nstages) > map + total) return 0;
+
+  for(k=0; k<c->nstages; k++)
+    if(!relocateArgv(map, total, &c->stages[k])) return 0;
+
+  if(!relocate(c->redirectfile)) return 0;
+
+  if(c->nbranches == 0) return c->branches == NULL;
+  if(depth > 8 || c->nbranches < 0 || c->branches == NULL || !relocate(c->branches)) return 0;
+  if((char*)(c->branches + c->nbranches) > map + total) return 0;
+
+  for(k=0; k<c->nbranches; k++)
+    if(!relocateCommand(map, total, &c->branches[k], depth + 1)) return 0;
+
+  return 1;
+}
+
+// Turns every offset of the mapped plan into a pointer. Returns 0 if some offset is out of the map.
+static int relocatePlan(char *map, size_t total, struct planentry *entries, int n) {
+  struct planentry *e;
+  int i;
+
+  for(i=0; i<n; i++) {
+    e = &entries[i];
+
+    if(!relocateArgv(map, total, &e->args)) return 0;
+    if(e->kind == PLAN_JOB && !relocateCommand(map, total, &e->command, 0)) return 0;
+  }
+
+  return 1;
+}
+
+/*
+    Maps the plan file at planpath if it was compiled from the batch file (whose stat is st).
+    The batch file is only hashed (into *hash, setting *hashed) when its size, time or inode changed.
+    Returns 0 if the plan can be used.
+*/
+static int mapPlan(const char *planpath, const char *path, struct stat *st, uint64_t *hash, int *hashed, struct plan *p) {
+  struct stat pst;
+  struct planheader *h;
+  char *map;
+  int fd;
+
+  if((fd = open(planpath, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+  if(fstat(fd, &pst) < 0 || pst.st_size < (off_t)sizeof(struct planheader)) {
+    close(fd);
+    return -1;
+  }
+
+  // Private and writable: the offsets are turned into pointers in place, the file stays as it is
+  map = (char*)mmap(NULL, pst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return -1;
+
+  h = (struct planheader*)map;
+  if(memcmp(h->magic, PLAN_MAGIC, sizeof(PLAN_MAGIC)) != 0 || h->version != PLAN_VERSION ||
+     h->layout != PLAN_LAYOUT || h->total != (uint64_t)pst.st_size || map[pst.st_size - 1] != '\0' ||
+     sizeof(struct planheader) + (uint64_t)h->nentries * sizeof(struct planentry) > h->total)
+    goto reject;
+
+  if(!sameFile(h, st)) {
+    if(!*hashed) {
+      if(hashFile(path, hash) < 0) goto reject;
+      *hashed = 1;
+    }
+    if(h->hash != *hash) goto reject;
+  }
+
+  p->entries = (struct planentry*)(map + sizeof(struct planheader));
+  p->nentries = h->nentries;
+  if(!relocatePlan(map, pst.st_size, p->entries, p->nentries)) goto reject;
+
+  p->unterminated = h->unterminated;
+  p->cached = 1;
+  p->map = map;
+  p->mapsize = pst.st_size;
+  return 0;
+
+reject:
+  munmap(map, pst.st_size);
+  p->entries = NULL;
+  p->nentries = 0;
+  return -1;
+}
+
+int loadPlan(const char *path, struct plan *p, int nthreads, int usecache) {
+  char planpath[PATH_MAX + 8];
+  struct stat st, after;
+  uint64_t hash = 0;
+  int hashed = 0;
+
+  memset(p, 0, sizeof(*p));
+
+  // A name cut short could be another file, mapped or replaced: no plan file then
+  if(usecache && snprintf(planpath, sizeof(planpath), "%s.plan", path) >= (int)sizeof(planpath)) usecache = 0;
+
+  if(usecache) {
+    if(stat(path, &st) < 0) return -1;
+
+    if(mapPlan(planpath, path, &st, &hash, &hashed, p) == 0) return 0;
+
+    // Hashed before loadBatch(), which terminates the tokens in place
+    if(!hashed && hashFile(path, &hash) < 0) return -1;
+  }
+
+  if(loadBatch(path, &p->batch, nthreads) < 0) return -1;
+  compilePlan(p);
+
+  // Only saved if the batch file didn't change while it was being read
+  if(usecache && stat(path, &after) == 0 && after.st_size == st.st_size &&
+     after.st_mtim.tv_sec == st.st_mtim.tv_sec && after.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+    savePlan(planpath, p, &st, hash);
+
+  return 0;
+}
+
+void unloadPlan(struct plan *p) {
+  if(p->map) munmap(p->map, p->mapsize);
+  else {
+    unloadBatch(&p->batch);
+    arenaFree(&p->arena);
+  }
+  memset(p, 0, sizeof(*p));
+}
@@ -0,0 +1,111 @@
+#include <stddef.h>
+
+/*
+    Compiled form of a batch file: the lines to run, with their sections and operators resolved.
+
+    Compiling a batch file means loading and tokenizing it (loadBatch()), going through the
+    %BEGIN/%END sections and #INTERSTART/#INTERSTOP blocks, and splitting every line on its
+    '|', '>' and '>>' operators (compileCommand()). The result is a list of entries, in line order:
+
+    PLAN_JOB        :   a line to run, with its argv arrays, redirection and JOB_ flags
+    PLAN_DIRECTIVE  :   a %-line inside a section, handed to the scheduler (jobDirective())
+
+    Lines outside of the sections, blank and comment lines, %BEGIN/%END and the
+    #INTERSTART/#INTERSTOP markers leave no entry.
+
+    A whole plan is only compiled for the options that need every line before the first one
+    runs (--dry-run, --plan-cache, --share-prefix, --sections). Otherwise the batch file is
+    compiled line by line as it runs, with planLine() (see stream.h).
+
+    With --plan-cache, the plan is also written next to the batch file as <batch-file>.plan, and
+    later runs load it with a single mmap() instead of compiling the batch file again.
+
+    HOW IT WORKS:
+
+    1. The plan file holds a header, the entries, and then every argv array and string they
+       point to. In the file, the pointers are offsets from the start of the file.
+    2. The header records the size, modification time, inode and FNV-1a hash of the batch file
+       it was compiled from. If the size, time and inode still match, the plan is used without
+       reading the batch file at all. Otherwise the batch file is hashed, and the plan is only
+       used if the hash matches; if not, the batch file is compiled and the plan rewritten.
+    3. A plan that is used is mapped MAP_PRIVATE, and its offsets are turned into pointers in
+       place: nothing is copied, parsed or allocated per line.
+
+    The plan file is only a cache: it is rewritten whenever it doesn't match (a different batch
+    file, another version of the executor, a corrupt file), and it is not shared across machines.
+*/
+
+// Kinds of entries
+#define PLAN_JOB        0
+#define PLAN_DIRECTIVE  1
+
+/*
+    One entry of a plan.
+
+    lineno  :   line number in the batch file
+    kind    :   PLAN_JOB or PLAN_DIRECTIVE
+    section :   which %BEGIN/%END section the line is in (0 for the first one)
+    flags   :   JOB_ flags of the line (PLAN_JOB)
+    args    :   tokens of the line, followed by NULL
+    command :   the line split on its operators (PLAN_JOB)
+*/
+struct planentry {
+    int lineno;
+    int kind;
+    int section;
+    int flags;
+    char **args;
+    struct command command;
+};
+
+/*
+    A batch file, compiled or loaded from its plan file.
+
+    entries     :   every entry, in line order
+    nentries    :   number of entries
+    unterminated:   the last %BEGIN has no matching %END
+    cached      :   the plan was loaded from its plan file
+
+    The rest is what the entries point to: the loaded batch file and an arena (compiled plan),
+    or the mapped plan file.
+*/
+struct plan {
+    struct planentry *entries;
+    int nentries;
+    int unterminated;
+    int cached;
+
+    struct batch batch;
+    struct arena arena;
+    char *map;
+    size_t mapsize;
+};
+
+/*
+    Where the reading of a batch file is: inside a %BEGIN/%END section or not (begin), the
+    JOB_ flags of the lines read (JOB_INTER inside #INTERSTART/#INTERSTOP), and the number of
+    sections begun so far. Starts zeroed.
+*/
+struct sections {
+    int begin;
+    int flags;
+    int count;
+};
+
+/*
+    Compiles one line of a batch file, read in order, the way the executor always has: only
+    lines between %BEGIN and %END count, #INTERSTART/#INTERSTOP set JOB_INTER for the lines
+    after them, and a line starting with '%' is a directive. Returns 1 and fills e if the line
+    is a job or a directive (its stage arrays allocated from a), 0 if it leaves no entry.
+*/
+int planLine(struct sections *st, struct batchline *l, struct planentry *e, struct arena *a);
+
+/*
+    Compiles the batch file at path (parsed with up to nthreads threads, see loadBatch()). With
+    usecache, loads <path>.plan instead when it matches the batch file, and (re)writes it when it doesn't.
+    Returns 0, or -1 (with errno set) if the batch file can't be read.
+*/
+int loadPlan(const char *path, struct plan *p, int nthreads, int usecache);
+
+// Releases everything loadPlan() allocated or mapped
+void unloadPlan(struct plan *p);
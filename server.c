@@ -0,0 +1,417 @@
+#define _GNU_SOURCE   // for struct ucred and accept4()
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// for open()
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "parse.h"
+#include "execute.h"
+#include "jobs.h"
+#include "plan.h"
+#include "stream.h"
+#include "output.h"
+#include "server.h"
+
+// One connection
+struct client {
+  int fd;
+  int id;                   // connections are numbered from 1
+  pid_t pid;                // of the process that connected (0 if unknown)
+  char *cwd;                // where its lines run, from its SERVER_CWD header (NULL: the server's directory)
+
+  char *buf;                // buf[start..len) is read but not added yet
+  size_t start, len, cap;
+  int eof;                  // the client is done sending its batch
+  int lineno;
+  struct sections st;
+  struct chunks chunks;     // lines of the client, released once they are written (see stream.h)
+
+  struct planentry **held;  // directives waiting for the line they apply to
+  int nheld, capheld;
+
+  int submitted, finished, failed, timedout;
+  double cpu;               // seconds of CPU used by the finished lines
+  int closing;              // "### done" is queued: closed once its output is written
+
+  struct client *next;
+};
+
+static struct client *clients;
+static int nextid = 1;
+
+// What %STATUS still shows of a closed client: the SERVER_HISTORY latest ones, in a ring
+struct summary {
+  int id;
+  pid_t pid;
+  int submitted, failed, timedout;
+  double cpu;
+};
+
+static struct summary history[SERVER_HISTORY];
+static int nclosed;
+
+static void *allocOrDie(void *p) {
+  if(!p) {
+    printf("Memory allocation unsuccessful! Exiting...\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/*
+    Answers %STATUS, after the blocks already written to fd: one line per connected client, then
+    one per closed client still in the history, latest first.
+*/
+static void sendStatus(int fd) {
+  struct client *c;
+  struct summary *h;
+  char line[256];
+  int len, i;
+
+  for(c = clients; c; c = c->next) {
+    len = snprintf(line, sizeof(line), "### status: client %d (pid %d): %d lines, %d finished, %d failed, %d timed out, %.3fs CPU%s\n",
+                   c->id, (int)c->pid, c->submitted, c->finished, c->failed, c->timedout, c->cpu, c->fd == fd ? " (this one)" : "");
+    queueText(line, len);
+  }
+
+  for(i = nclosed - 1; i >= 0 && i >= nclosed - SERVER_HISTORY; i--) {
+    h = &history[i % SERVER_HISTORY];
+    len = snprintf(line, sizeof(line), "### status: client %d (pid %d): done, %d lines, %d failed, %d timed out, %.3fs CPU\n",
+                   h->id, (int)h->pid, h->submitted, h->failed, h->timedout, h->cpu);
+    queueText(line, len);
+  }
+  flushOutputTo(fd);
+}
+
+// Queues "### done" once every line a client submitted is written back (see serveJobs())
+static void doneClient(struct client *c) {
+  char line[96];
+  int len;
+
+  len = snprintf(line, sizeof(line), "### done: %d lines, %d failed\n", c->submitted, c->failed);
+  queueText(line, len);
+  flushOutputTo(c->fd);
+  c->closing = 1;
+}
+
+// Closes a client once everything queued for it is written (or it went away), keeping its summary
+static void closeClient(struct client *c) {
+  struct summary *h = &history[nclosed++ % SERVER_HISTORY];
+  struct client **p;
+
+  h->id = c->id;
+  h->pid = c->pid;
+  h->submitted = c->submitted;
+  h->failed = c->failed;
+  h->timedout = c->timedout;
+  h->cpu = c->cpu;
+
+  dropOutput(c->fd);
+  unwatchInput(c->fd);
+  close(c->fd);
+
+  for(p = &clients; *p != c; p = &(*p)->next)
+    ;
+  *p = c->next;
+
+  free(c->buf);
+  free(c->held);
+  free(c->cwd);
+  freeChunks(&c->chunks);
+  free(c);
+}
+
+static int clientDone(struct client *c) {
+  return c->eof && c->start == c->len && c->finished == c->submitted;
+}
+
+// No more lines of a client are added while the window is full, or while its connection has
+// more than SERVER_PENDING bytes waiting for it: a client that doesn't read only holds itself up
+static int clientHeld(struct client *c) {
+  return jobsFull() || pendingOutput(c->fd) >= SERVER_PENDING;
+}
+
+// Called for every line of a client once its block is written to the connection
+static void lineFlushed(void *owner, struct job *job) {
+  struct client *c = (struct client*)owner;
+  int k;
+
+  chunkFlushed(&c->chunks);
+  c->finished++;
+  if(job->status != 0) c->failed++;
+  if(job->timedout) c->timedout++;
+  for(k=0; k<job->nprocs; k++)
+    c->cpu += job->procs[k].usage.ru_utime.tv_sec + job->procs[k].usage.ru_utime.tv_usec / 1e6 +
+              job->procs[k].usage.ru_stime.tv_sec + job->procs[k].usage.ru_stime.tv_usec / 1e6;
+}
+
+// Hands an entry of a client to the scheduler: a directive is held until the client's next line
+static void clientEntry(struct client *c, struct planentry *e) {
+  int i;
+
+  if(e->kind == PLAN_DIRECTIVE) {
+    if(c->nheld == c->capheld) {
+      c->capheld = c->capheld ? c->capheld * 2 : 4;
+      c->held = (struct planentry**)allocOrDie(realloc(c->held, c->capheld * sizeof(struct planentry*)));
+    }
+    c->held[c->nheld++] = e;
+    return;
+  }
+
+  // The directives of this client apply to this line, and to nothing in between
+  for(i=0; i<c->nheld; i++)
+    if(!jobDirective(c->held[i]->args))
+      printf("Client %d: unknown directive ignored: %s\n", c->id, c->held[i]->args[0]);
+  c->nheld = 0;
+
+  chunkJob(&c->chunks);
+  ownJobs(c->fd, c->cwd, c, lineFlushed);
+  addJob(e->args, &e->command, e->lineno, e->section, e->flags);
+  ownJobs(-1, NULL, NULL, NULL);
+  c->submitted++;
+}
+
+/*
+    Compiles one complete line of a client into its current chunk and hands it to the scheduler,
+    as main() does for a batch file. The chunk ends with its section, or after STREAM_CHUNK
+    lines, unless directives compiled into it are still held.
+*/
+static void clientLine(struct client *c, const char *text, size_t len) {
+  struct arena *a;
+  struct batchline l;
+  struct planentry *e;
+  int begin = c->st.begin;
+  size_t n = strlen(SERVER_CWD);
+
+  // The directory of the client comes before its batch (see submitBatch()), and isn't one of its lines
+  if(c->lineno == 0 && c->cwd == NULL && len > n + 1 && strncmp(text, SERVER_CWD, n) == 0 && text[n] == ' ' && text[n + 1] == '/') {
+    c->cwd = (char*)allocOrDie(strndup(text + n + 1, len - n - 1));
+    return;
+  }
+
+  a = chunkArena(&c->chunks);
+  e = (struct planentry*)arenaAlloc(a, sizeof(struct planentry));
+
+  l.lineno = ++c->lineno;
+  l.text = arenaStrndup(a, text, len);
+  l.len = len;
+  l.args = parseLine(l.text, a);
+  for(l.nargs = 0; l.args[l.nargs] != NULL; l.nargs++)
+    ;
+
+  if(l.nargs == 1 && strcmp(l.args[0], "%STATUS") == 0) sendStatus(c->fd);
+  else if(planLine(&c->st, &l, e, a)) clientEntry(c, e);
+
+  if(c->nheld == 0 && ((begin && !c->st.begin) || c->chunks.lines >= STREAM_CHUNK)) endChunk(&c->chunks);
+}
+
+// Adds the lines a client has sent so far, as long as the window has room for them
+static void clientLines(struct client *c) {
+  char *eol;
+
+  while(!clientHeld(c) && (eol = (char*)memchr(c->buf + c->start, '\n', c->len - c->start)) != NULL) {
+    clientLine(c, c->buf + c->start, eol - (c->buf + c->start));
+    c->start = eol + 1 - c->buf;
+  }
+
+  // Last line, without a newline
+  if(c->eof && c->start < c->len && !clientHeld(c) && memchr(c->buf + c->start, '\n', c->len - c->start) == NULL) {
+    clientLine(c, c->buf + c->start, c->len - c->start);
+    c->start = c->len;
+  }
+}
+
+// Whether more of a client's batch should be read: it isn't held, and no complete line is waiting
+static int wantsInput(struct client *c) {
+  return !clientHeld(c) && memchr(c->buf + c->start, '\n', c->len - c->start) == NULL;
+}
+
+// The connection of a client is readable
+static void readClient(struct client *c) {
+  ssize_t n;
+
+  if(c->start > 0) {
+    memmove(c->buf, c->buf + c->start, c->len - c->start);
+    c->len -= c->start;
+    c->start = 0;
+  }
+  if(c->len == c->cap) {
+    c->cap = c->cap ? c->cap * 2 : STREAM_BUFFER;
+    c->buf = (char*)allocOrDie(realloc(c->buf, c->cap));
+  }
+
+  n = recv(c->fd, c->buf + c->len, c->cap - c->len, 0);
+  if(n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+  if(n <= 0) {
+    c->eof = 1;
+    // Still watched (not wanted), so that it is closed only once its lines are written
+    watchInput(c->fd, 0);
+  }
+  else c->len += n;
+}
+
+static void acceptClient(int lfd) {
+  struct client *c;
+  struct ucred cred;
+  socklen_t credlen = sizeof(cred);
+  int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+  if(fd < 0) {
+    if(errno != EINTR && errno != EAGAIN) perror("accept");
+    return;
+  }
+
+  c = (struct client*)allocOrDie(calloc(1, sizeof(struct client)));
+  c->fd = fd;
+  c->id = nextid++;
+  if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == 0) c->pid = cred.pid;
+
+  c->next = clients;
+  clients = c;
+
+  watchInput(fd, 1);
+}
+
+static struct client *findClient(int fd) {
+  struct client *c;
+  for(c = clients; c; c = c->next)
+    if(c->fd == fd) return c;
+  return NULL;
+}
+
+int serveJobs(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  struct client *c, *next;
+  int ready[SERVER_READY];
+  int lfd, n, i;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  // A socket left behind by an earlier server is replaced; any other file is not
+  if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+  if((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) return -1;
+  if(bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, SERVER_BACKLOG) < 0) {
+    close(lfd);
+    return -1;
+  }
+
+  beginJobs(NULL);
+  watchInput(lfd, 1);
+
+  for(;;) {
+    for(c = clients; c; c = next) {
+      next = c->next;
+      if(!c->closing) clientLines(c);
+      if(!c->closing && clientDone(c)) doneClient(c);
+      if(c->closing && pendingOutput(c->fd) == 0) {
+        closeClient(c);
+        continue;
+      }
+      if(!c->eof) watchInput(c->fd, wantsInput(c));
+      watchOutput(c->fd, pendingOutput(c->fd) > 0);
+    }
+
+    n = stepJobs(ready, SERVER_READY);
+
+    // Readable or writable (output is kept for it): both are tried, neither waits
+    for(i=0; i<n; i++) {
+      if(ready[i] == lfd) acceptClient(lfd);
+      else if((c = findClient(ready[i])) != NULL) {
+        if(pendingOutput(c->fd) > 0) flushOutputTo(c->fd);
+        if(!c->eof && wantsInput(c)) readClient(c);
+      }
+    }
+  }
+}
+
+int submitBatch(const char *socketpath, const char *path) {
+  struct sockaddr_un addr;
+  struct pollfd fds[2];
+  char buf[65536], out[65536];
+  size_t start = 0, len = 0;    // out[start..len) is read from the batch but not sent yet
+  char cwd[PATH_MAX];
+  int fd, in;
+  ssize_t n;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(socketpath) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, socketpath);
+
+  if((in = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+
+  // Sent first: the lines run in our directory, not the server's
+  if(getcwd(cwd, sizeof(cwd)) != NULL && strchr(cwd, '\n') == NULL)
+    len = snprintf(out, sizeof(out), "%s %s\n", SERVER_CWD, cwd);
+  if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(in);
+    return -1;
+  }
+
+  // The batch is sent while the results are read: the server stops reading when its
+  // window is full, and could otherwise wait for us to read what it has written
+  fds[0].fd = fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = fd;
+  fds[1].events = POLLOUT;
+
+  for(;;) {
+    if(poll(fds, in >= 0 ? 2 : 1, -1) < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+
+    if(fds[0].revents) {
+      n = read(fd, buf, sizeof(buf));
+      if(n <= 0) break;
+      fwrite(buf, 1, n, stdout);
+    }
+
+    if(in >= 0 && fds[1].revents) {
+      if(start == len) {
+        n = read(in, out, sizeof(out));
+        if(n < 0 && errno == EINTR) continue;
+        start = 0;
+        len = n > 0 ? n : 0;
+      }
+      // A short send leaves the rest for the next time the connection is writable
+      if(len > start) {
+        n = send(fd, out + start, len - start, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n > 0) start += n;
+        if(n > 0 || (n < 0 && (errno == EINTR || errno == EAGAIN))) continue;
+      }
+      // The whole batch is sent (EOF), or can't be: the server is told it is complete
+      close(in);
+      in = -1;
+      shutdown(fd, SHUT_WR);
+    }
+  }
+
+  if(in >= 0) close(in);
+  close(fd);
+  return 0;
+}
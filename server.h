@@ -0,0 +1,72 @@
+/*
+    Local job server (--serve) and its client (--submit).
+
+    One executor listens on a Unix domain socket, and any number of producers on the host
+    submit batches to it, in the usual %BEGIN/%END syntax. All the lines of all the clients go
+    through the same scheduler, so -j N is a limit for the whole host, and the caches of the
+    executor (resolved command paths, pooled output chunks) stay warm across batches.
+
+    Protocol (text, both ways):
+
+    client -> server    a "%CWD <absolute path>" line, the directory the lines of the batch
+                        run in and their relative file names are resolved in (without it,
+                        the server's), then the batch, as in a batch file. Shutting down the writing side of the
+                        connection ends it. A "%STATUS" line (anywhere) asks for the status
+                        of every connected client.
+    server -> client    the block of every line of the batch, in line order, exactly as it
+                        would be in OUTPUT.txt ("### line <n>: exit <status>" and the output),
+                        then "### done: <lines> lines, <failed> failed" once all of them are
+                        written, and the connection is closed. The answer to %STATUS is a
+                        "### status ..." line per client, sent as soon as it is read: the
+                        connected ones, then the SERVER_HISTORY latest closed ones ("done").
+
+    HOW IT WORKS:
+
+    1. The listening socket and every connection are inputs of the scheduler's reactor (see
+       watchInput()): accepting clients, reading their lines and reaping children all happen
+       in one epoll loop.
+    2. Every client has its own read buffer, line numbers, section state and chunks of
+       compiled lines (see struct chunks, released as their lines are written). Complete
+       lines are compiled with planLine() and added to the scheduler, owned by the client
+       (ownJobs()): their blocks are written to its connection, not to OUTPUT.txt.
+       Directives are held back until the line they apply to arrives, so that the %LABEL,
+       %AFTER or %TIMEOUT of one client never applies to the line of another.
+    3. Connections are non-blocking. The blocks a connection can't take yet are kept for it
+       (see flushOutputTo()) and written once it is writable, so a client that stops reading
+       its results doesn't hold the others up.
+    4. Backpressure: while the scheduler's window is full, no connection is read. A client
+       with more than SERVER_PENDING bytes kept for it isn't read either, and none of its lines
+       are added: it can only hold up its own lines (those already in the window still finish,
+       and their blocks are kept).
+    5. Dependencies between lines come from the files they name, whichever client they
+       belong to (relative names are made absolute with the client's directory, so the same
+       name in two directories is two files), and labels are shared: a client can wait for another client's line.
+*/
+
+// Connections waiting to be accepted (listen())
+#define SERVER_BACKLOG 64
+
+// Ready descriptors handled per step of the reactor
+#define SERVER_READY 64
+
+// Closed clients %STATUS still reports
+#define SERVER_HISTORY 32
+
+// First line a client sends: "%CWD <absolute path>", the directory its lines run in
+#define SERVER_CWD "%CWD"
+
+// Bytes of output kept for a client past which no more of its lines are added
+#define SERVER_PENDING (4 * 1024 * 1024)
+
+/*
+    Listens on the Unix domain socket at path (replacing a stale socket file) and runs the
+    batches of its clients until the executor is killed. The scheduler must have been set up
+    with initJobs(). Only returns (-1, with errno set) if the socket can't be set up.
+*/
+int serveJobs(const char *path);
+
+/*
+    Sends the batch file at path to the server listening at socketpath, and copies the
+    results to stdout. Returns 0 once the server is done with the batch, -1 on errors.
+*/
+int submitBatch(const char *socketpath, const char *path);
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+// for stat()
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "execute.h"
+#include "stats.h"
+
+// What is kept of a line for the summary table
+struct linestats {
+  int lineno;
+  int status;
+  double wall, user, sys;   // ms
+  long maxrss;              // KB
+  long long bytes;
+};
+
+static FILE *statsfp;
+static const char *statspath;
+
+static struct linestats top[STATS_TOP];   // lines with the most CPU time, most first
+static int ntop;
+static struct linestats total;
+static int nlines;
+
+// Totals of the pipe edges
+static long nedges, ngrown;
+static long long edgebytes;
+static double edgestalled;
+
+void openStats(const char *path) {
+  statsfp = fopen(path, "w");
+  if(statsfp == NULL) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  statspath = path;
+}
+
+static double ms(struct timeval *tv) {
+  return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+static double elapsed(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+// Writes "exit": n or "signal": n for a wait status
+static void writeStatus(int status) {
+  if(WIFSIGNALED(status)) fprintf(statsfp, "\"signal\": %d", WTERMSIG(status));
+  else fprintf(statsfp, "\"exit\": %d", WEXITSTATUS(status));
+}
+
+// Writes s as a JSON string
+static void writeString(const char *s) {
+  fputc('"', statsfp);
+  for(; s && *s; s++) {
+    if(*s == '"' || *s == '\\') fprintf(statsfp, "\\%c", *s);
+    else if((unsigned char)*s < 0x20) fprintf(statsfp, "\\u%04x", *s);
+    else fputc(*s, statsfp);
+  }
+  fputc('"', statsfp);
+}
+
+// Keeps l in the summary table if it is among the STATS_TOP lines with the most CPU time
+static void keepTop(struct linestats *l) {
+  int i;
+
+  if(ntop == STATS_TOP && top[ntop-1].user + top[ntop-1].sys >= l->user + l->sys) return;
+  if(ntop < STATS_TOP) ntop++;
+
+  for(i=ntop-1; i>0 && top[i-1].user + top[i-1].sys < l->user + l->sys; i--)
+    top[i] = top[i-1];
+  top[i] = *l;
+}
+
+void recordJob(struct job *job, size_t bytes) {
+  struct linestats l;
+  struct process *p;
+  struct edge *e;
+  struct timespec *first = NULL, *last = NULL;
+  struct stat st;
+  int i, n;
+
+  if(statsfp == NULL) return;
+
+  memset(&l, 0, sizeof(l));
+  l.lineno = job->lineno;
+  l.status = job->status;
+  l.bytes = bytes;
+
+  // The output went to the '>' or '>>' target instead: what it gained since the line opened it
+  if(job->outfile != NULL)
+    l.bytes = stat(job->outfile, &st) == 0 && st.st_size >= job->outstart ? st.st_size - job->outstart : 0;
+
+  for(i=0; i<job->nprocs; i++) {
+    p = &job->procs[i];
+    if(!p->reaped) continue;
+    l.user += ms(&p->usage.ru_utime);
+    l.sys += ms(&p->usage.ru_stime);
+    if(p->usage.ru_maxrss > l.maxrss) l.maxrss = p->usage.ru_maxrss;
+    if(first == NULL || elapsed(&p->start, first) > 0) first = &p->start;
+    if(last == NULL || elapsed(last, &p->end) > 0) last = &p->end;
+  }
+  if(first != NULL) l.wall = elapsed(first, last);
+
+  fprintf(statsfp, "{\"line\": %d, ", l.lineno);
+  writeStatus(l.status);
+  if(job->timedout) fprintf(statsfp, ", \"timed_out_ms\": %d", job->timedout);
+  fprintf(statsfp, ", \"wall_ms\": %.3f, \"user_ms\": %.3f, \"sys_ms\": %.3f, \"maxrss_kb\": %ld, \"bytes_out\": %lld, \"stages\": [",
+          l.wall, l.user, l.sys, l.maxrss, l.bytes);
+
+  for(i=0, n=0; i<job->nprocs; i++) {
+    p = &job->procs[i];
+    if(!p->reaped) continue;
+    fprintf(statsfp, "%s{\"stage\": %d, \"command\": ", n++ ? ", " : "", p->stage);
+    writeString(p->command);
+    fprintf(statsfp, ", \"pid\": %d, ", (int)p->pid);
+    writeStatus(p->status);
+    fprintf(statsfp, ", \"wall_ms\": %.3f, \"user_ms\": %.3f, \"sys_ms\": %.3f, \"maxrss_kb\": %ld}",
+            elapsed(&p->start, &p->end), ms(&p->usage.ru_utime), ms(&p->usage.ru_stime), p->usage.ru_maxrss);
+  }
+
+  fprintf(statsfp, "]");
+
+  if(job->nedges > 0) {
+    fprintf(statsfp, ", \"edges\": [");
+    for(i=0; i<job->nedges; i++) {
+      e = &job->edges[i];
+      fprintf(statsfp, "%s{\"edge\": %d, \"from\": ", i ? ", " : "", e->stage + 1);
+      writeString(e->command);
+      fprintf(statsfp, ", \"writer_bytes\": %lld, \"stall_ms\": %.0f, \"pipe_kb\": %d, \"grown\": %d}",
+              e->wrote, e->stalled, e->size / 1024, e->grown);
+
+      nedges++;
+      ngrown += e->grown;
+      edgestalled += e->stalled;
+      if(e->wrote > 0) edgebytes += e->wrote;
+    }
+    fprintf(statsfp, "]");
+  }
+
+  fprintf(statsfp, "}\n");
+
+  nlines++;
+  total.wall += l.wall;
+  total.user += l.user;
+  total.sys += l.sys;
+  total.bytes += l.bytes;
+  if(l.maxrss > total.maxrss) total.maxrss = l.maxrss;
+
+  keepTop(&l);
+}
+
+// One row of the summary table
+static void printRow(const char *line, const char *status, struct linestats *l) {
+  printf("%-8s %-10s %12.1f %12.1f %12.1f %12ld %14lld\n", line, status, l->wall, l->user, l->sys, l->maxrss, l->bytes);
+}
+
+void closeStats(void) {
+  char line[32], status[32];
+  int i;
+
+  if(statsfp == NULL) return;
+  fclose(statsfp);
+  statsfp = NULL;
+
+  printf("\nResource usage (%d lines, per line in %s):\n\n", nlines, statspath);
+  printf("%-8s %-10s %12s %12s %12s %12s %14s\n", "Line", "Status", "Wall ms", "User ms", "Sys ms", "MaxRSS KB", "Bytes out");
+
+  for(i=0; i<ntop; i++) {
+    snprintf(line, sizeof(line), "%d", top[i].lineno);
+    if(WIFSIGNALED(top[i].status)) snprintf(status, sizeof(status), "signal %d", WTERMSIG(top[i].status));
+    else snprintf(status, sizeof(status), "exit %d", WEXITSTATUS(top[i].status));
+    printRow(line, status, &top[i]);
+  }
+
+  printRow("Total", "", &total);
+
+  if(nedges > 0)
+    printf("\nPipe edges: %ld, %lld bytes written by their writers (to any descriptor), %.0f ms with a full pipe, %ld pipes grown\n",
+           nedges, edgebytes, edgestalled, ngrown);
+}
@@ -0,0 +1,37 @@
+/*
+    Resource accounting of the lines of a batch file (--stats).
+
+    Every process is reaped with wait4(), which returns its resource usage along with its
+    status (see struct process). Once a line is done, one JSON object is written for it to
+    the stats file (OUTPUT.stats.jsonl, next to OUTPUT.txt), in line order:
+
+      {"line": 3, "exit": 0, "wall_ms": 12.1, "user_ms": 4.0, "sys_ms": 2.1, "maxrss_kb": 3412,
+       "bytes_out": 120, "stages": [{"stage": 0, "command": "cat", "pid": 4242, "exit": 0,
+       "wall_ms": 11.9, "user_ms": 1.0, "sys_ms": 1.2, "maxrss_kb": 1800}, ...],
+       "edges": [{"edge": 1, "from": "cat", "writer_bytes": 1048576, "stall_ms": 40, "pipe_kb": 256, "grown": 2}, ...]}
+
+    "exit" is replaced by "signal" for a process killed by a signal, and a line killed because
+    of its timeout (see jobs.h) also has "timed_out_ms". The line's status is the
+    one of its last command; its CPU times add up those of all its processes, its max RSS is
+    the biggest one among them and its wall time goes from the first start to the last reap.
+    bytes_out counts what the line wrote to its output: OUTPUT.txt, or the '>'/'>>' target.
+    The helpers copying pipe edges in #INTERSTART blocks appear as stage -1 ("tee").
+    "edges" (pipelines only) has the counters of every pipe between two stages (see struct edge):
+    how much the stage before it wrote in all (to the pipe, but also to stderr or any other
+    file: not the traffic of the pipe alone), how long the pipe was full, and its final capacity.
+
+    At the end of the run, a summary table lists the lines that used the most CPU, followed by
+    the totals of the pipe edges.
+*/
+
+// Number of lines listed in the summary table
+#define STATS_TOP 10
+
+// Creates (truncates) the stats file. Until this is called, recordJob() does nothing.
+void openStats(const char *path);
+
+// Writes the stats of a finished line. bytes is what it wrote to OUTPUT.txt (when not redirected).
+void recordJob(struct job *job, size_t bytes);
+
+// Prints the summary table and closes the stats file
+void closeStats(void);
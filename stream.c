@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "parse.h"
+#include "execute.h"
+#include "jobs.h"
+#include "plan.h"
+#include "stream.h"
+
+// Lines compiled into one arena, from the oldest on (see struct chunks)
+struct chunk {
+  struct arena arena;
+  int added;        // jobs added from its lines
+  int flushed;      // of these, flushed so far
+  int closed;       // no more lines go to it
+  struct chunk *next;
+};
+
+static void *allocOrDie(void *p) {
+  if(!p) {
+    printf("Memory allocation unsuccessful! Exiting...\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+// Releases the oldest chunks that are closed and have all their jobs flushed
+static void releaseChunks(struct chunks *q) {
+  struct chunk *c;
+
+  while((c = q->first) != NULL && c->closed && c->flushed == c->added) {
+    q->first = c->next;
+    if(q->last == c) q->last = NULL;
+
+    // One of them is kept, with one block of its arena, for the next chunk
+    if(q->spare == NULL) {
+      arenaReset(&c->arena);
+      q->spare = c;
+    }
+    else {
+      arenaFree(&c->arena);
+      free(c);
+    }
+  }
+}
+
+struct arena *chunkArena(struct chunks *q) {
+  struct chunk *c;
+
+  if(q->last == NULL || q->last->closed) {
+    if((c = q->spare) != NULL) q->spare = NULL;
+    else c = (struct chunk*)allocOrDie(calloc(1, sizeof(struct chunk)));
+    c->added = c->flushed = c->closed = 0;
+    c->next = NULL;
+
+    if(q->last) q->last->next = c;
+    else q->first = c;
+    q->last = c;
+    q->lines = 0;
+  }
+
+  q->lines++;
+  return &q->last->arena;
+}
+
+void chunkJob(struct chunks *q) {
+  q->last->added++;
+}
+
+void endChunk(struct chunks *q) {
+  if(q->last == NULL || q->last->closed) return;
+  q->last->closed = 1;
+  releaseChunks(q);
+}
+
+void chunkFlushed(struct chunks *q) {
+  q->first->flushed++;
+  releaseChunks(q);
+}
+
+void freeChunks(struct chunks *q) {
+  struct chunk *c, *next;
+
+  for(c = q->first; c; c = next) {
+    next = c->next;
+    arenaFree(&c->arena);
+    free(c);
+  }
+  if(q->spare) {
+    arenaFree(&q->spare->arena);
+    free(q->spare);
+  }
+  memset(q, 0, sizeof(*q));
+}
+
+// Called for every line of the stream once its block is written
+static void streamFlushed(void *owner, struct job *job) {
+  chunkFlushed((struct chunks*)owner);
+}
+
+/*
+    Compiles one complete line of the stream into the current chunk and hands it over if it
+    makes an entry. The chunk ends with its section, or after STREAM_CHUNK lines.
+*/
+static void streamLine(struct sections *st, struct chunks *q, int lineno, const char *text, size_t len,
+                       void (*entry)(struct planentry *e)) {
+  struct arena *a = chunkArena(q);
+  struct batchline l;
+  struct planentry *e = (struct planentry*)arenaAlloc(a, sizeof(struct planentry));
+  int begin = st->begin;
+
+  l.lineno = lineno;
+  l.text = arenaStrndup(a, text, len);
+  l.len = len;
+  l.args = parseLine(l.text, a);
+  for(l.nargs = 0; l.args[l.nargs] != NULL; l.nargs++)
+    ;
+
+  if(planLine(st, &l, e, a)) {
+    // Counted first: a line --resume finds done is flushed as it is added
+    if(e->kind == PLAN_JOB) chunkJob(q);
+    ownJobs(-1, NULL, q, streamFlushed);
+    entry(e);
+    ownJobs(-1, NULL, NULL, NULL);
+  }
+
+  if((begin && !st->begin) || q->lines >= STREAM_CHUNK) endChunk(q);
+}
+
+int runStream(int fd, void (*entry)(struct planentry *e)) {
+  struct sections st = { 0, 0, 0 };
+  struct chunks q;
+  size_t cap = STREAM_BUFFER;
+  size_t start = 0, len = 0;    // buf[start..len) is read but not added yet
+  char *buf = (char*)allocOrDie(malloc(cap));
+  char *eol;
+  int lineno = 0;
+  int eof = 0;
+  int ready;
+  ssize_t n;
+
+  memset(&q, 0, sizeof(q));
+  beginJobs("OUTPUT.txt");
+
+  for(;;) {
+    // Lines already read go first, as long as the window has room for them
+    while(!jobsFull() && (eol = (char*)memchr(buf + start, '\n', len - start)) != NULL) {
+      streamLine(&st, &q, ++lineno, buf + start, eol - (buf + start), entry);
+      start = eol + 1 - buf;
+    }
+
+    if(eof) {
+      unwatchInput(fd);
+      if(start == len) break;
+      if(!jobsFull()) {
+        // Last line, without a newline
+        streamLine(&st, &q, ++lineno, buf + start, len - start, entry);
+        start = len;
+        continue;
+      }
+      stepJobs(NULL, 0);
+      continue;
+    }
+
+    // Only read more once the buffered lines have been added (backpressure)
+    watchInput(fd, !jobsFull() && memchr(buf + start, '\n', len - start) == NULL);
+    if(stepJobs(&ready, 1) == 0) continue;
+
+    if(start > 0) {
+      memmove(buf, buf + start, len - start);
+      len -= start;
+      start = 0;
+    }
+    if(len == cap) {
+      cap *= 2;
+      buf = (char*)allocOrDie(realloc(buf, cap));
+    }
+
+    n = read(fd, buf + len, cap - len);
+    if(n < 0) {
+      if(errno == EINTR || errno == EAGAIN) continue;
+      perror("Reading the stream");
+      eof = 1;
+    }
+    else if(n == 0) eof = 1;
+    else len += n;
+  }
+
+  endJobs();
+  freeChunks(&q);
+  free(buf);
+
+  return st.begin;
+}
@@ -0,0 +1,71 @@
+/*
+    Running a batch while it is being written (--stream).
+
+    Instead of a batch file, the lines are read from a pipe (stdin) or a named FIFO, and each
+    line is added to the scheduler as soon as it is complete: a producer can keep appending
+    %BEGIN/%END sections to a long-running executor, and their lines start while it is still
+    writing. The lines go through the same section rules as a batch file (see planLine()),
+    and OUTPUT.txt is written in line order as they finish, exactly as for a batch file.
+
+    A batch file is run the same way, read from its descriptor, unless an option needs all of
+    its lines before the first one runs (--dry-run, --plan-cache, --share-prefix, --sections):
+    only the lines in the scheduler's window are compiled and in memory at a time.
+
+    HOW IT WORKS:
+
+    1. The input descriptor is one more source in the epoll set of the scheduler (see
+       watchInput()), so reading lines and reaping children happen in the same loop.
+    2. Complete lines are copied out of the read buffer into the arena of the current chunk,
+       tokenized and compiled there, and handed to the scheduler. A chunk takes the lines up to
+       the next %END, or STREAM_CHUNK lines, and is released once all its lines are flushed:
+       the memory used doesn't grow with the number of lines read (see struct chunks).
+    3. Backpressure: while as many lines as the scheduler's window holds are waiting to be
+       flushed (see jobsFull()), the input is not read at all. The buffered lines stay in
+       the buffer, and the producer blocks once the pipe is full, until earlier lines finish.
+    4. At EOF, a last line without a newline is added too, and every line runs to completion.
+       A FIFO opened by name is opened read-write, so that it never reaches EOF when a
+       producer closes it: the executor keeps waiting for the next one.
+*/
+
+// Initial size of the read buffer; it grows for longer lines
+#define STREAM_BUFFER 65536
+
+// Most lines compiled into one chunk (see struct chunks)
+#define STREAM_CHUNK 256
+
+struct chunk;
+
+/*
+    Memory of lines that are compiled while earlier ones run (--stream, and every client of
+    --serve), in chunks of lines with an arena each. Lines are flushed in the order they are
+    added, so the oldest chunk always holds the next line to be flushed, and a chunk is released
+    once it is closed and every job added from it is flushed.
+
+    chunkArena()    arena for the next line: the current chunk's, or a new one's
+    chunkJob()      one more job is added from the current chunk
+    endChunk()      closes the current chunk: the next line starts another one
+    chunkFlushed()  the oldest job added is flushed (call it from the flushed callback of ownJobs())
+    freeChunks()    releases every chunk, flushed or not
+
+    lines counts the lines compiled into the current chunk. Starts zeroed.
+*/
+struct chunks {
+    struct chunk *first, *last;   // oldest, and current (unless closed)
+    struct chunk *spare;          // released chunk kept for the next one
+    int lines;
+};
+
+struct arena *chunkArena(struct chunks *q);
+void chunkJob(struct chunks *q);
+void endChunk(struct chunks *q);
+void chunkFlushed(struct chunks *q);
+void freeChunks(struct chunks *q);
+
+/*
+    Reads the lines of a batch from fd until EOF and runs them as they come (the scheduler
+    must have been set up with initJobs()). Every job or directive line inside a section is
+    compiled into a chunk and handed to entry(), which adds it to the scheduler (a job entry
+    must be added with addJob(), a directive may only be used until entry() returns).
+    Returns 1 if the last %BEGIN has no matching %END, 0 otherwise.
+*/
+int runStream(int fd, void (*entry)(struct planentry *e));